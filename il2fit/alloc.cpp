@@ -0,0 +1,109 @@
+#include "alloc.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+using std::atomic;
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::mutex;
+using std::size_t;
+
+namespace {
+
+atomic<bool> counting(false);
+
+// Threads' counters, linked by hand since allocating here would count
+class counter;
+
+mutex counters_lock;
+counter* counters = nullptr;
+size_t exited = 0;              // Counted on threads that are gone
+
+class counter
+{
+public:
+    counter()
+    {
+        lock_guard<mutex> lock(counters_lock);
+        next_ = counters;
+        counters = this;
+    }
+
+    ~counter()
+    {
+        lock_guard<mutex> lock(counters_lock);
+        exited += n_.load(memory_order_relaxed);
+        for (auto p = &counters; *p; p = &(*p)->next_) {
+            if (*p == this) {
+                *p = next_;
+                break;
+            }
+        }
+    }
+
+    // Only the owning thread adds, so there's no need for a locked
+    // increment
+    void
+    add()
+    {
+        n_.store(n_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    static size_t
+    total()
+    {
+        lock_guard<mutex> lock(counters_lock);
+        size_t ans = exited;
+        for (auto p = counters; p; p = p->next_) {
+            ans += p->n_.load(memory_order_relaxed);
+        }
+        return ans;
+    }
+
+private:
+    atomic<size_t> n_{0};
+    counter* next_ = nullptr;
+};
+
+} // namespace
+
+void
+count_allocations(bool on)
+{
+    counting.store(on, memory_order_relaxed);
+}
+
+size_t
+allocations()
+{
+    return counter::total();
+}
+
+void*
+operator new(size_t n)
+{
+    if (counting.load(memory_order_relaxed)) {
+        thread_local counter count;
+        count.add();
+    }
+    if (const auto p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
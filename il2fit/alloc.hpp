@@ -0,0 +1,20 @@
+#ifndef IL2FIT_ALLOC_HPP
+#define IL2FIT_ALLOC_HPP
+
+#include <cstddef>
+
+// alloc.cpp replaces the global operator new to count heap allocations,
+// for --stats and the tests. It's linked into programs only, never into
+// the library.
+
+// Count allocations on every thread from now on, or stop. Off at
+// startup, when allocating costs a flag check more than malloc().
+void
+count_allocations(bool on);
+
+// Allocations counted so far, summed over threads, including those that
+// have exited
+std::size_t
+allocations();
+
+#endif  // IL2FIT_ALLOC_HPP
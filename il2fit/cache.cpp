@@ -0,0 +1,366 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "crc.hpp"
+
+using std::error_code;
+using std::hex;
+using std::ifstream;
+using std::ios;
+using std::lock_guard;
+using std::mutex;
+using std::ofstream;
+using std::ostringstream;
+using std::runtime_error;
+using std::setfill;
+using std::setw;
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::uint64_t;
+using std::uintmax_t;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+//----------------------------------------------------------------------------
+// XXH64
+
+constexpr uint64_t xxh_prime1 = 0x9E3779B185EBCA87u;
+constexpr uint64_t xxh_prime2 = 0xC2B2AE3D27D4EB4Fu;
+constexpr uint64_t xxh_prime3 = 0x165667B19E3779F9u;
+constexpr uint64_t xxh_prime4 = 0x85EBCA77C2B2AE63u;
+constexpr uint64_t xxh_prime5 = 0x27D4EB2F165667C5u;
+
+uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+unsigned
+octet(char c)
+{
+    return static_cast<unsigned char>(c);
+}
+
+// Little-endian n bytes at p
+uint64_t
+load_le(const char* p, int n)
+{
+    uint64_t ans = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        ans = ans << 8 | octet(p[i]);
+    }
+    return ans;
+}
+
+uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * xxh_prime2, 31) * xxh_prime1;
+}
+
+uint64_t
+xxh_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh_round(0, v)) * xxh_prime1 + xxh_prime4;
+}
+
+} // namespace
+
+uint64_t
+xxh64(string_view data, uint64_t seed)
+{
+    const char* p = data.data();
+    size_t n = data.size();
+    uint64_t h;
+
+    if (n >= 32) {
+        uint64_t v[4] = {
+            seed + xxh_prime1 + xxh_prime2,
+            seed + xxh_prime2,
+            seed,
+            seed - xxh_prime1
+        };
+        for (; n >= 32; p += 32, n -= 32) {
+            for (int i = 0; i < 4; ++i) {
+                v[i] = xxh_round(v[i], load_le(p + 8 * i, 8));
+            }
+        }
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (const auto x : v) {
+            h = xxh_merge(h, x);
+        }
+    } else {
+        h = seed + xxh_prime5;
+    }
+
+    h += data.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        h = rotl(h ^ xxh_round(0, load_le(p, 8)), 27) * xxh_prime1 +
+            xxh_prime4;
+    }
+    if (n >= 4) {
+        h = rotl(h ^ load_le(p, 4) * xxh_prime1, 23) * xxh_prime2 +
+            xxh_prime3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; ++p, --n) {
+        h = rotl(h ^ octet(*p) * xxh_prime5, 11) * xxh_prime1;
+    }
+
+    h ^= h >> 33;
+    h *= xxh_prime2;
+    h ^= h >> 29;
+    h *= xxh_prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+//----------------------------------------------------------------------------
+// Content-addressed FIT cache
+
+namespace {
+
+int
+pid()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+string
+contents(const fs::path& path)
+{
+    ifstream file(path, ios::in | ios::binary);
+    if (!file) {
+        return string();
+    }
+    ostringstream ans;
+    ans << file.rdbuf();
+    return ans.str();
+}
+
+} // namespace
+
+fit_cache::fit_cache(const string& dir, uintmax_t limit) :
+    dir_(dir),
+    limit_(limit)
+{
+    error_code ec;
+    fs::create_directories(dir_, ec);
+    if (!fs::is_directory(dir_, ec)) {
+        throw runtime_error("Can't use cache directory \"" + dir + "\"");
+    }
+    for (const auto& e : entries()) {
+        size_ += e.size;
+    }
+}
+
+string
+fit_cache::key(string_view data)
+{
+    ostringstream ans;
+    ans << hex << setfill('0')
+        << setw(16) << xxh64(data, 0)
+        << setw(16) << xxh64(data, xxh_prime5);
+    return ans.str();
+}
+
+bool
+fit_cache::get(const string& key, string& fit)
+{
+    const auto path = dir_ / (key + ".fit");
+    fit = contents(path);
+    // Half-written or damaged files don't pass the CRC
+    if (fit.size() < 14 || crc16(0, fit) != 0) {
+        return false;
+    }
+    error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void
+fit_cache::put(const string& key, string_view fit)
+{
+    // Unique to the process and thread, for processes sharing the cache
+    const auto path = dir_ / (key + ".fit");
+    ostringstream name;
+    name << key << '.' << pid() << '.' << std::this_thread::get_id()
+         << ".tmp";
+    const auto tmp = dir_ / name.str();
+    {
+        ofstream file(tmp, ios::out | ios::binary | ios::trunc);
+        file.write(fit.data(), fit.size());
+        if (!file.flush()) {
+            file.close();
+            error_code ec;
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    // Same clock as get() uses, file systems may stamp coarser
+    error_code ec;
+    fs::last_write_time(tmp, fs::file_time_type::clock::now(), ec);
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        return;
+    }
+
+    lock_guard<mutex> lock(m_);
+    size_ += fit.size();
+    if (size_ > limit_) {
+        evict();
+    }
+}
+
+vector<fit_cache::entry>
+fit_cache::entries() const
+{
+    vector<entry> ans;
+    error_code ec;
+    for (fs::directory_iterator it(dir_, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        const auto& p = it->path();
+        error_code fec;
+        const auto size = it->file_size(fec);
+        const auto used = it->last_write_time(fec);
+        if (p.extension() == ".fit" && !fec) {
+            ans.push_back({ p, size, used });
+        }
+    }
+    return ans;
+}
+
+// Down to 3/4 of the limit, so that it isn't needed on every put().
+// Sizes are counted again, other processes may have changed them. File
+// systems with coarse timestamps give entries the same time, which are
+// then taken in path order, the same on every run.
+void
+fit_cache::evict()
+{
+    auto es = entries();
+    stable_sort(es.begin(), es.end(), [](const entry& a, const entry& b) {
+            return a.used < b.used || (a.used == b.used && a.path < b.path);
+        });
+    size_ = 0;
+    for (const auto& e : es) {
+        size_ += e.size;
+    }
+    for (const auto& e : es) {
+        if (size_ <= limit_ / 4 * 3) {
+            break;
+        }
+        error_code ec;
+        if (fs::remove(e.path, ec)) {
+            size_ -= e.size;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Tests
+
+#ifdef _WITH_TESTS
+
+#include <catch.hpp>
+
+TEST_CASE("XXH64 reference values", "[cache]")
+{
+    const string_view fox("The quick brown fox jumps over the lazy dog");
+    CHECK(xxh64("", 0) == 0xEF46DB3751D8E999u);
+    CHECK(xxh64("abc", 0) == 0x44BC2CF5AD770999u);
+    CHECK(xxh64(fox, 0) == 0x0B242D361FDA71BCu);
+    CHECK(xxh64(fox, xxh_prime5) == 0x3774063D79EEF0F6u);
+}
+
+TEST_CASE("Cache keys", "[cache]")
+{
+    const auto key = fit_cache::key("abc");
+    CHECK(key == "44bc2cf5ad770999" + key.substr(16));
+    CHECK(key.size() == 32);
+    CHECK(fit_cache::key("abd") != key);
+}
+
+namespace {
+
+// Files that pass the cache's CRC check
+string
+fit_file(const string& data)
+{
+    auto ans = data;
+    const auto crc = crc16(0, ans);
+    ans.push_back(static_cast<char>(crc & 0xFF));
+    ans.push_back(static_cast<char>(crc >> 8));
+    return ans;
+}
+
+} // namespace
+
+TEST_CASE("Cache hits and evicts", "[cache]")
+{
+    const auto dir = fs::temp_directory_path() /
+        ("il2fit-test-cache-" + std::to_string(pid()));
+    fs::remove_all(dir);
+
+    const auto a = fit_file("Pretend FIT file a");
+    const auto b = fit_file("Pretend FIT file bb");
+
+    {
+        // Not enough room for both
+        fit_cache cache(dir.string(), a.size() + b.size() - 1);
+        string fit;
+        CHECK_FALSE(cache.get("a", fit));
+        cache.put("a", a);
+        REQUIRE(cache.get("a", fit));
+        CHECK(fit == a);
+        // Used before b even where timestamps are coarse
+        fs::last_write_time(dir / "a.fit",
+                            fs::file_time_type::clock::now() -
+                            std::chrono::hours(1));
+        cache.put("b", b);
+        CHECK_FALSE(cache.get("a", fit));
+        REQUIRE(cache.get("b", fit));
+        CHECK(fit == b);
+    }
+    {
+        // Entries outlive the cache object, damaged ones are misses
+        fit_cache cache(dir.string(), 1 << 20);
+        string fit;
+        CHECK(cache.get("b", fit));
+        ofstream(dir / "c.fit", ios::out | ios::binary) << b.substr(1);
+        CHECK_FALSE(cache.get("c", fit));
+    }
+
+    // Nothing left behind by put()
+    for (const auto& e : fs::directory_iterator(dir)) {
+        CHECK(e.path().extension() == ".fit");
+    }
+
+    fs::remove_all(dir);
+}
+
+#endif  // _WITH_TESTS
@@ -0,0 +1,56 @@
+#ifndef IL2FIT_CACHE_HPP
+#define IL2FIT_CACHE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Directory of FIT files named by a hash of what they're made from,
+// with the least recently used ones removed once they take more than
+// the limit. Several threads and processes may share one directory.
+class fit_cache
+{
+public:
+    fit_cache(const std::string& dir, std::uintmax_t limit);
+
+    // 128 bits of data, as 32 hex digits. Callers put in it everything
+    // the FIT file depends on.
+    static std::string
+    key(std::string_view data);
+
+    // A hit also makes the entry the most recently used
+    bool
+    get(const std::string& key, std::string& fit);
+
+    // Best effort, a failure only means a miss next time
+    void
+    put(const std::string& key, std::string_view fit);
+
+private:
+    struct entry
+    {
+        std::filesystem::path path;
+        std::uintmax_t size;
+        std::filesystem::file_time_type used;
+    };
+
+    std::vector<entry>
+    entries() const;
+
+    void
+    evict();
+
+    const std::filesystem::path dir_;
+    const std::uintmax_t limit_;
+    std::mutex m_;
+    std::uintmax_t size_ = 0;
+};
+
+// XXH64 of data, behind fit_cache::key(), exposed for tests
+std::uint64_t
+xxh64(std::string_view data, std::uint64_t seed);
+
+#endif  // IL2FIT_CACHE_HPP
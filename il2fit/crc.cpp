@@ -0,0 +1,481 @@
+#include "crc.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IL2FIT_WITH_CLMUL 1
+#include <immintrin.h>
+#endif
+
+using std::size_t;
+using std::string_view;
+using std::uint16_t;
+using std::uint32_t;
+using std::uint64_t;
+
+namespace {
+
+//----------------------------------------------------------------------------
+// Slicing-by-8
+
+// Reflected 0x8005
+constexpr uint16_t poly = 0xA001;
+
+// t[k][b] is the CRC of byte b followed by k zero bytes
+struct slice8_tables
+{
+    constexpr
+    slice8_tables() :
+        t{}
+    {
+        for (unsigned b = 0; b < 256; ++b) {
+            uint16_t crc = b;
+            for (int i = 0; i < 8; ++i) {
+                crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+            }
+            t[0][b] = crc;
+        }
+        for (unsigned b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k) {
+                t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+            }
+        }
+    }
+
+    uint16_t t[8][256];
+};
+
+constexpr slice8_tables tables;
+
+uint16_t
+byte(uint16_t crc, char c)
+{
+    const auto b = static_cast<unsigned char>(c);
+    return (crc >> 8) ^ tables.t[0][(crc ^ b) & 0xFF];
+}
+
+//----------------------------------------------------------------------------
+// Shifting through zero bytes
+
+// The CRC register is a vector over GF(2), and a zero bit moves it by a
+// linear operator: row i is where bit i goes
+uint16_t
+times(const uint16_t* op, uint16_t v)
+{
+    uint16_t ans = 0;
+    for (; v != 0; v >>= 1, ++op) {
+        if (v & 1) {
+            ans ^= *op;
+        }
+    }
+    return ans;
+}
+
+void
+square(uint16_t* ans, const uint16_t* op)
+{
+    for (int i = 0; i < 16; ++i) {
+        ans[i] = times(op, op[i]);
+    }
+}
+
+#ifdef IL2FIT_WITH_CLMUL
+
+//----------------------------------------------------------------------------
+// Folding with carry-less multiplication
+
+// x^n mod x^16 + x^15 + x^2 + 1
+constexpr uint32_t
+xpow(unsigned n)
+{
+    uint32_t r = 1;
+    for (unsigned i = 0; i < n; ++i) {
+        r <<= 1;
+        if (r & 0x10000) {
+            r ^= 0x18005;
+        }
+    }
+    return r;
+}
+
+// x^n mod P as a reflected 64-bit multiplier, coefficient of x^e in bit
+// 63 - e. Reflected products come out one bit short of the 128-bit
+// register, which is why fold() uses one power of x less.
+constexpr uint64_t
+reflected(uint32_t r)
+{
+    uint64_t ans = 0;
+    for (int e = 0; e < 16; ++e) {
+        if (r >> e & 1) {
+            ans |= uint64_t(1) << (63 - e);
+        }
+    }
+    return ans;
+}
+
+// Multipliers that move a 128-bit block bits further along the message,
+// high and low half
+struct fold_constants
+{
+    constexpr
+    fold_constants(unsigned bits) :
+        hi(reflected(xpow(bits - 1))),
+        lo(reflected(xpow(bits + 63)))
+    {
+    }
+
+    uint64_t hi;
+    uint64_t lo;
+};
+
+constexpr fold_constants k512(512);
+constexpr fold_constants k128(128);
+
+#define CLMUL_TARGET __attribute__((target("sse2,pclmul")))
+
+CLMUL_TARGET
+__m128i
+fold(const fold_constants& k)
+{
+    return _mm_set_epi64x(static_cast<long long>(k.hi),
+                          static_cast<long long>(k.lo));
+}
+
+// a * x^bits + b, modulo P but still 128 bits wide
+CLMUL_TARGET
+__m128i
+fold(__m128i a, __m128i k, __m128i b)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+                                       _mm_clmulepi64_si128(a, k, 0x11)),
+                         b);
+}
+
+CLMUL_TARGET
+__m128i
+load(const char* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// Fold the data down to 16 bytes with the same remainder, then finish
+// with tables. Requires at least 64 bytes.
+CLMUL_TARGET
+uint16_t
+crc16_fold(uint16_t crc, string_view data)
+{
+    const char* p = data.data();
+    size_t n = data.size();
+
+    // Reflected CRC with no final xor: the running CRC goes into the
+    // first two message bytes
+    __m128i x0 = _mm_xor_si128(load(p), _mm_cvtsi32_si128(crc));
+    __m128i x1 = load(p + 16);
+    __m128i x2 = load(p + 32);
+    __m128i x3 = load(p + 48);
+    p += 64;
+    n -= 64;
+
+    const auto k4 = fold(k512);
+    for (; n >= 64; p += 64, n -= 64) {
+        x0 = fold(x0, k4, load(p));
+        x1 = fold(x1, k4, load(p + 16));
+        x2 = fold(x2, k4, load(p + 32));
+        x3 = fold(x3, k4, load(p + 48));
+    }
+
+    const auto k1 = fold(k128);
+    x1 = fold(x0, k1, x1);
+    x2 = fold(x1, k1, x2);
+    x3 = fold(x2, k1, x3);
+    for (; n >= 16; p += 16, n -= 16) {
+        x3 = fold(x3, k1, load(p));
+    }
+
+    char block[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(block), x3);
+    return crc16_slice8(crc16_slice8(0, string_view(block, 16)),
+                        string_view(p, n));
+}
+
+#endif  // IL2FIT_WITH_CLMUL
+
+} // namespace
+
+uint16_t
+crc16_slice8(uint16_t crc, string_view data)
+{
+    const char* p = data.data();
+    size_t n = data.size();
+
+    for (; n >= 8; p += 8, n -= 8) {
+        const auto b = [p](int i) {
+            return static_cast<unsigned char>(p[i]);
+        };
+        crc = tables.t[7][(b(0) ^ crc) & 0xFF] ^
+            tables.t[6][(b(1) ^ (crc >> 8)) & 0xFF] ^
+            tables.t[5][b(2)] ^ tables.t[4][b(3)] ^
+            tables.t[3][b(4)] ^ tables.t[2][b(5)] ^
+            tables.t[1][b(6)] ^ tables.t[0][b(7)];
+    }
+    for (; n > 0; ++p, --n) {
+        crc = byte(crc, *p);
+    }
+
+    return crc;
+}
+
+uint16_t
+crc16_clmul(uint16_t crc, string_view data)
+{
+#ifdef IL2FIT_WITH_CLMUL
+    if (data.size() >= 64 && have_clmul()) {
+        return crc16_fold(crc, data);
+    }
+#endif
+    return crc16_slice8(crc, data);
+}
+
+// Like zlib's crc32_combine(): crc_a goes through size_b zero bytes,
+// by squaring the one bit operator, and the CRC is linear in the rest
+uint16_t
+crc16_combine(uint16_t crc_a, uint16_t crc_b, size_t size_b)
+{
+    uint16_t odd[16], even[16];
+
+    odd[0] = poly;
+    for (int i = 1; i < 16; ++i) {
+        odd[i] = uint16_t(1) << (i - 1);
+    }
+    square(even, odd);          // 2 bits
+    square(odd, even);          // 4 bits
+
+    while (size_b > 0) {
+        square(even, odd);      // 1, 4, 16... bytes
+        if (size_b & 1) {
+            crc_a = times(even, crc_a);
+        }
+        size_b >>= 1;
+        if (size_b == 0) {
+            break;
+        }
+        square(odd, even);      // 2, 8, 32... bytes
+        if (size_b & 1) {
+            crc_a = times(odd, crc_a);
+        }
+        size_b >>= 1;
+    }
+
+    return crc_a ^ crc_b;
+}
+
+bool
+have_clmul()
+{
+#ifdef IL2FIT_WITH_CLMUL
+    static const bool ans = __builtin_cpu_supports("sse2") &&
+        __builtin_cpu_supports("pclmul");
+    return ans;
+#else
+    return false;
+#endif
+}
+
+// With the multipliers constant, folding beats slice8 from its 64 byte
+// minimum up (crc_benchmark: 3.9 vs 2.2 GB/s at 64 bytes, 16 vs 2.1 at 1 KiB)
+uint16_t
+crc16(uint16_t crc, string_view data)
+{
+    return crc16_clmul(crc, data);
+}
+
+//----------------------------------------------------------------------------
+// Tests
+
+#ifdef _WITH_TESTS
+
+#include <catch.hpp>
+
+#include <random>
+#include <string>
+
+using std::mt19937;
+using std::string;
+
+namespace {
+
+// The SDK's nibble at a time CRC
+uint16_t
+reference(uint16_t crc, string_view data)
+{
+    static const uint16_t table[16] = {
+        0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+        0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+    };
+    for (const auto c : data) {
+        const auto b = static_cast<unsigned char>(c);
+        crc = (crc >> 4) ^ table[crc & 0xF] ^ table[b & 0xF];
+        crc = (crc >> 4) ^ table[crc & 0xF] ^ table[b >> 4];
+    }
+    return crc;
+}
+
+string
+random_bytes(size_t n, unsigned seed)
+{
+    mt19937 gen(seed);
+    string ans(n, '\0');
+    for (auto& c : ans) {
+        c = static_cast<char>(gen());
+    }
+    return ans;
+}
+
+} // namespace
+
+TEST_CASE("CRC check value", "[crc]")
+{
+    CHECK(crc16(0, "") == 0);
+    CHECK(crc16_slice8(0, "123456789") == 0xBB3D);
+    CHECK(crc16_clmul(0, "123456789") == 0xBB3D);
+}
+
+TEST_CASE("CRC of all lengths", "[crc]")
+{
+    const auto data = random_bytes(1100, 1);
+    for (size_t n = 0; n <= data.size(); ++n) {
+        const auto s = string_view(data).substr(0, n);
+        const auto expected = reference(0x1234, s);
+        REQUIRE(crc16_slice8(0x1234, s) == expected);
+        REQUIRE(crc16_clmul(0x1234, s) == expected);
+        REQUIRE(crc16(0x1234, s) == expected);
+    }
+}
+
+TEST_CASE("CRC in pieces", "[crc]")
+{
+    const auto data = random_bytes(100000, 2);
+    const string_view s(data);
+    const auto expected = reference(0, s);
+    CHECK(crc16(0, s) == expected);
+    for (const size_t k : { 1, 63, 64, 4097, 99999 }) {
+        CHECK(crc16(crc16(0, s.substr(0, k)), s.substr(k)) == expected);
+    }
+}
+
+TEST_CASE("Combine CRCs", "[crc]")
+{
+    const auto data = random_bytes(70000, 4);
+    const string_view s(data);
+    for (const size_t k : { 0, 1, 14, 255, 4096, 69999, 70000 }) {
+        const auto a = s.substr(0, k);
+        const auto b = s.substr(k);
+        CHECK(crc16_combine(crc16(0x1234, a), crc16(0, b), b.size()) ==
+              crc16(0x1234, s));
+    }
+}
+
+TEST_CASE("CRC of a file with its CRC is 0", "[crc]")
+{
+    auto data = random_bytes(5000, 3);
+    const auto crc = crc16(0, data);
+    data.push_back(static_cast<char>(crc & 0xFF));
+    data.push_back(static_cast<char>(crc >> 8));
+    CHECK(crc16(0, data) == 0);
+}
+
+#endif  // _WITH_TESTS
+
+//----------------------------------------------------------------------------
+// Benchmark against the SDK
+
+#ifdef _WITH_BENCHMARKS
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include <fit_crc.h>
+
+using std::cout;
+using std::endl;
+using std::fixed;
+using std::function;
+using std::mt19937;
+using std::setprecision;
+using std::setw;
+using std::string;
+
+namespace chrono = std::chrono;
+
+namespace {
+
+uint16_t
+sdk(uint16_t crc, string_view data)
+{
+    for (const auto c : data) {
+        crc = FitCRC_Get16(crc, static_cast<FIT_UINT8>(c));
+    }
+    return crc;
+}
+
+// Best of a few runs, in MB/s. Small inputs are repeated to about 1 MiB
+// a run, so the clock sees more than the call overhead.
+double
+throughput(const function<uint16_t (uint16_t, string_view)>& f,
+           string_view data, uint16_t expected)
+{
+    const size_t reps = std::max<size_t>(1, (size_t(1) << 20) / data.size());
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+        uint16_t crc = 0;
+        const auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < reps; ++i) {
+            crc = f(0, data);
+            if (crc != expected) {
+                return -1;
+            }
+        }
+        const chrono::duration<double> t = chrono::steady_clock::now() - start;
+        if (t.count() > 0) {
+            best = std::max(best, reps * data.size() / t.count() / 1e6);
+        }
+    }
+    return best;
+}
+
+} // namespace
+
+void
+crc_benchmark()
+{
+    mt19937 gen(42);
+
+    cout << "CRC MB/s, clmul: " << (have_clmul() ? "yes" : "no") << endl;
+    cout << setw(10) << "bytes" << setw(14) << "FitCRC_Get16"
+         << setw(14) << "slice8" << setw(14) << "clmul"
+         << setw(14) << "crc16" << endl;
+
+    for (const size_t size : { 64, 128, 256, 512, 1 << 10, 4 << 10,
+                               64 << 10, 1 << 20, 16 << 20 }) {
+        string data(size, '\0');
+        for (auto& c : data) {
+            c = static_cast<char>(gen());
+        }
+        const auto expected = sdk(0, data);
+
+        cout << setw(10) << size << fixed << setprecision(1)
+             << setw(14) << throughput(sdk, data, expected)
+             << setw(14) << throughput(crc16_slice8, data, expected)
+             << setw(14) << throughput(crc16_clmul, data, expected)
+             << setw(14) << throughput(crc16, data, expected)
+             << endl;
+    }
+}
+
+#endif  // _WITH_BENCHMARKS
@@ -0,0 +1,38 @@
+#ifndef IL2FIT_CRC_HPP
+#define IL2FIT_CRC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// FIT CRC-16 (reflected 0x8005, no final xor) of data, continuing
+// from crc. The file CRC starts from 0.
+std::uint16_t
+crc16(std::uint16_t crc, std::string_view data);
+
+// CRC of a followed by b, from crc_a = crc16(crc, a), crc_b =
+// crc16(0, b) and the length of b, without going over b again
+std::uint16_t
+crc16_combine(std::uint16_t crc_a, std::uint16_t crc_b, std::size_t size_b);
+
+// Implementations behind crc16(), exposed for tests and benchmarks
+
+std::uint16_t
+crc16_slice8(std::uint16_t crc, std::string_view data);
+
+// Falls back to crc16_slice8() below 64 bytes or if the CPU has no
+// PCLMULQDQ
+std::uint16_t
+crc16_clmul(std::uint16_t crc, std::string_view data);
+
+bool
+have_clmul();
+
+#ifdef _WITH_BENCHMARKS
+// Throughput of the SDK's CRC and of ours from 64 bytes to 16 MiB,
+// to stdout
+void
+crc_benchmark();
+#endif
+
+#endif  // IL2FIT_CRC_HPP
@@ -0,0 +1,189 @@
+#include "fit2il.hpp"
+
+#include <charconv>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "verify.hpp"
+
+using std::make_pair;
+using std::pair;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::string_view;
+
+namespace {
+
+unsigned
+octet(char c)
+{
+    return static_cast<unsigned char>(c);
+}
+
+// IL key of a FIT field, and the names of its values for enums
+struct il_field
+{
+    FIT_UINT8 num;
+    string_view key;
+    const string_view* (*name)(FIT_UINT32 value);
+};
+
+template <const auto& Table>
+const string_view*
+enum_name(FIT_UINT32 value)
+{
+    using T = std::decay_t<decltype(*Table.find(""))>;
+    return Table.name(static_cast<T>(value));
+}
+
+// Fields that the parsers read as they are encoded. Others, e.g.
+// file_id's type or the scaled forms of workout step values, are
+// il2fit's defaults or read into the same fields.
+const il_field file_creator_fields[] = {
+    { file_creator::software_version.num, "software_version", nullptr },
+    { file_creator::hardware_version.num, "hardware_version", nullptr }
+};
+
+const il_field file_id_fields[] = {
+    { file_id::serial_number.num, "serial_number", nullptr },
+    { file_id::time_created.num, "time_created", nullptr },
+    { file_id::number.num, "number", nullptr }
+};
+
+const il_field workout_fields[] = {
+    { workout::sport.num, "sport", enum_name<workout::sports> },
+    { workout::capabilities.num, "capabilities", nullptr },
+    { workout::num_valid_steps.num, "num_valid_steps", nullptr },
+    { workout::wkt_name.num, "wkt_name", nullptr }
+};
+
+const il_field workout_step_fields[] = {
+    { workout_step::message_index.num, "message_index", nullptr },
+    { workout_step::wkt_step_name.num, "wkt_step_name", nullptr },
+    { workout_step::duration_type.num, "duration_type",
+      enum_name<workout_step::duration_types> },
+    { workout_step::duration_value.num, "duration_value", nullptr },
+    { workout_step::target_type.num, "target_type",
+      enum_name<workout_step::target_types> },
+    { workout_step::target_value.num, "target_value", nullptr },
+    { workout_step::custom_target_value_low.num, "custom_target_value_low",
+      nullptr },
+    { workout_step::custom_target_value_high.num, "custom_target_value_high",
+      nullptr },
+    { workout_step::intensity.num, "intensity",
+      enum_name<workout_step::intensities> }
+};
+
+// IL message name and its fields, none for messages il2fit doesn't read
+template <size_t N>
+pair<string_view, const il_field*>
+il_message(string_view name, const il_field (&fields)[N], FIT_UINT8 num)
+{
+    for (const auto& f : fields) {
+        if (f.num == num) {
+            return make_pair(name, &f);
+        }
+    }
+    return make_pair(name, nullptr);
+}
+
+pair<string_view, const il_field*>
+il_message(FIT_UINT16 mesg, FIT_UINT8 num)
+{
+    switch (mesg) {
+    case FIT_MESG_NUM_FILE_CREATOR:
+        return il_message("file_creator", file_creator_fields, num);
+    case FIT_MESG_NUM_FILE_ID:
+        return il_message("file_id", file_id_fields, num);
+    case FIT_MESG_NUM_WORKOUT:
+        return il_message("workout", workout_fields, num);
+    case FIT_MESG_NUM_WORKOUT_STEP:
+        return il_message("workout_step", workout_step_fields, num);
+    default:
+        return make_pair(string_view(), nullptr);
+    }
+}
+
+void
+append_number(string& il, FIT_UINT32 value)
+{
+    char buf[16];
+    const auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    il.append(buf, r.ptr - buf);
+}
+
+} // namespace
+
+void
+fit2il(string_view fit, string& il)
+{
+    il.clear();
+    if (fit.empty()) {
+        throw runtime_error("Empty FIT file");
+    }
+
+    const auto record = [&](const local_mesg& m, string_view data,
+                            size_t offset) {
+        const auto name = il_message(m.num, 0).first;
+        if (name.empty()) {
+            return;
+        }
+        il += "begin\n";
+        il += name;
+        il += '\n';
+
+        for (size_t i = 0, pos = 0; i < m.fields.size(); i += 3) {
+            const auto size = octet(m.fields[i + 1]);
+            const auto type = octet(m.fields[i + 2]);
+            const auto raw = data.substr(pos, size);
+            pos += size;
+
+            const auto f = il_message(m.num, octet(m.fields[i])).second;
+            if (!f) {
+                continue;
+            }
+            if (type == FIT_BASE_TYPE_STRING) {
+                il += f->key;
+                il += '\n';
+                il += raw.substr(0, raw.find('\0'));
+                il += '\n';
+                continue;
+            }
+            if (size == 0 || size > 4) {
+                continue;
+            }
+            FIT_UINT32 v = 0;
+            for (size_t k = 0; k < size; ++k) {
+                v = v << 8 | octet(raw[m.big_endian ? k : size - 1 - k]);
+            }
+            if (v == base_invalid(type)) {
+                continue;
+            }
+            il += f->key;
+            il += '\n';
+            if (!f->name) {
+                append_number(il, v);
+            } else if (const auto n = f->name(v)) {
+                il += *n;
+            } else {
+                // The parser only reads enums by name
+                bad_fit(offset, string(name) + ' ' + string(f->key) + ' ' +
+                        std::to_string(v) + " has no IL name");
+            }
+            il += '\n';
+        }
+
+        il += "end\n";
+        il += name;
+        il += '\n';
+    };
+
+    for (size_t pos = 0; pos < fit.size();) {
+        if (pos > 0) {
+            il += "EOF\n";
+        }
+        pos += walk_fit(fit.substr(pos), pos, record);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef IL2FIT_FIT2IL_HPP
+#define IL2FIT_FIT2IL_HPP
+
+#include <string>
+#include <string_view>
+
+// Text IL that il2fit converts back to the same FIT file, as far as the
+// file has only what il2fit writes, into il. Chained files become
+// documents separated by EOF lines. Throws std::runtime_error for bad
+// structure or CRCs, and for enum values IL has no name for.
+void
+fit2il(std::string_view fit, std::string& il);
+
+#endif  // IL2FIT_FIT2IL_HPP
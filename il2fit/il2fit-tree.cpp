@@ -0,0 +1,627 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "il2fit.hpp"
+
+extern char** environ;
+
+using std::cerr;
+using std::condition_variable;
+using std::deque;
+using std::endl;
+using std::error_code;
+using std::exception;
+using std::ifstream;
+using std::ios;
+using std::istreambuf_iterator;
+using std::istringstream;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::nullopt;
+using std::ofstream;
+using std::optional;
+using std::pair;
+using std::runtime_error;
+using std::size_t;
+using std::sort;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+[[noreturn]]
+void
+error(const string& descr = "")
+{
+    throw runtime_error(descr);
+}
+
+//----------------------------------------------------------------------------
+// Bounded queue
+
+// Blocks producers while full, so that walking a large tree doesn't get
+// far ahead of the workers
+template <class T>
+class bounded_queue
+{
+public:
+    explicit
+    bounded_queue(size_t capacity) :
+        capacity_(capacity)
+    {
+    }
+
+    void
+    push(T item)
+    {
+        unique_lock<mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    // Next item, none once the queue is closed and empty
+    optional<T>
+    pop()
+    {
+        unique_lock<mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return nullopt;
+        }
+        auto ans = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return ans;
+    }
+
+    void
+    close()
+    {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    mutex mutex_;
+    condition_variable not_empty_;
+    condition_variable not_full_;
+    deque<T> items_;
+    const size_t capacity_;
+    bool closed_ = false;
+};
+
+//----------------------------------------------------------------------------
+// Input
+
+// Pipe with both ends closed on exec, so that other children don't
+// hold them open
+void
+make_pipe(int fds[2])
+{
+    if (pipe(fds) != 0) {
+        error(string("Can't create pipe: ") + strerror(errno));
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+// Runs wrk2il -mode bin with the .wrk file on stdin, and returns its
+// output, binary IL. Errors it prints are thrown.
+string
+wrk2il(const string& exe, const fs::path& path)
+{
+    int out[2], err[2];
+    make_pipe(out);
+    try {
+        make_pipe(err);
+    } catch (...) {
+        close(out[0]);
+        close(out[1]);
+        throw;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, path.c_str(), O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+
+    const char* argv[] = { exe.c_str(), "-mode", "bin", nullptr };
+    pid_t pid;
+    const int spawned = posix_spawnp(&pid, exe.c_str(), &actions, nullptr,
+                                     const_cast<char**>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    close(err[1]);
+    if (spawned != 0) {
+        close(out[0]);
+        close(err[0]);
+        error("Can't run \"" + exe + "\": " + strerror(spawned));
+    }
+
+    // Both pipes at once, so that neither fills up while reading the other
+    string il, msg;
+    pollfd fds[2] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 } };
+    string* bufs[2] = { &il, &msg };
+    for (int live = 2; live > 0; ) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            char buf[1 << 16];
+            const auto n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                bufs[i]->append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --live;
+            }
+        }
+    }
+    for (const auto& f : fds) {
+        if (f.fd >= 0) {
+            close(f.fd);
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        while (!msg.empty() && (msg.back() == '\n' || msg.back() == '\r')) {
+            msg.pop_back();
+        }
+        error(msg.empty() ? exe + " failed" : msg);
+    }
+    return il;
+}
+
+string
+contents(const fs::path& path)
+{
+    ifstream input(path, ios::in | ios::binary);
+    string ans((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    if (input.bad() || !input.is_open()) {
+        error("Can't read");
+    }
+    return ans;
+}
+
+//----------------------------------------------------------------------------
+// Conversion
+
+struct job
+{
+    fs::path input;
+    fs::path output;
+};
+
+// The other input that makes the same .fit file, as a.il does for a.wrk
+optional<fs::path>
+rival(const fs::path& input)
+{
+    auto ans = input;
+    ans.replace_extension(input.extension() == ".wrk" ? ".il" : ".wrk");
+    error_code ec;
+    if (fs::is_regular_file(ans, ec)) {
+        return ans;
+    }
+    return nullopt;
+}
+
+// As make does: nothing to do if the output exists and the input isn't
+// newer. Inputs with a rival never get here, so the output can only
+// have been made from this one.
+bool
+up_to_date(const job& j)
+{
+    error_code ec;
+    const auto out = fs::last_write_time(j.output, ec);
+    if (ec) {
+        return false;
+    }
+    const auto in = fs::last_write_time(j.input, ec);
+    return !ec && in <= out;
+}
+
+// Writes to a temporary file next to the output, and renames it, so
+// that a failed or interrupted run never leaves an output that looks
+// up to date
+void
+convert(const job& j, const string& wrk2il_exe)
+{
+    const auto il = j.input.extension() == ".wrk" ?
+        wrk2il(wrk2il_exe, j.input) : contents(j.input);
+
+    thread_local wrked::converter conv;
+    const auto fit = conv.convert(il);
+
+    error_code ec;
+    fs::create_directories(j.output.parent_path(), ec);
+    // Named after the process too, for runs into the same tree at once
+    auto tmp = j.output;
+    tmp += "." + std::to_string(getpid()) + ".tmp";
+    ofstream output(tmp, ios::out | ios::binary | ios::trunc);
+    output.write(fit.data(), fit.size());
+    output.close();
+    if (!output) {
+        fs::remove(tmp, ec);
+        error("Can't write \"" + j.output.string() + "\"");
+    }
+    fs::rename(tmp, j.output, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        error("Can't write \"" + j.output.string() + "\"");
+    }
+}
+
+struct summary
+{
+    size_t converted = 0;
+    size_t up_to_date = 0;
+    vector<pair<string, string>> failed; // Input path and error
+};
+
+// Walks the input tree on this thread, queueing .wrk and .il files that
+// are out of date for threads workers. A .wrk and a .il file that would
+// make the same .fit file both fail, and neither is converted.
+summary
+convert_tree(const fs::path& in_dir, const fs::path& out_dir,
+             size_t threads, bool force, const string& wrk2il_exe)
+{
+    summary ans;
+    mutex ans_mutex;
+    bounded_queue<job> queue(threads * 4);
+
+    vector<thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            while (const auto j = queue.pop()) {
+                try {
+                    convert(*j, wrk2il_exe);
+                    lock_guard<mutex> lock(ans_mutex);
+                    ++ans.converted;
+                } catch (const exception& exn) {
+                    lock_guard<mutex> lock(ans_mutex);
+                    ans.failed.emplace_back(j->input.string(), exn.what());
+                }
+            }
+        });
+    }
+
+    error_code ec;
+    for (fs::recursive_directory_iterator it(in_dir, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        const auto ext = it->path().extension();
+        if ((ext != ".wrk" && ext != ".il") || !it->is_regular_file(ec)) {
+            continue;
+        }
+        if (const auto other = rival(it->path())) {
+            lock_guard<mutex> lock(ans_mutex);
+            ans.failed.emplace_back(it->path().string(),
+                                    "\"" + other->filename().string() +
+                                    "\" makes the same .fit file");
+            continue;
+        }
+        job j{ it->path(), out_dir / it->path().lexically_relative(in_dir) };
+        j.output.replace_extension(".fit");
+        if (!force && up_to_date(j)) {
+            lock_guard<mutex> lock(ans_mutex);
+            ++ans.up_to_date;
+            continue;
+        }
+        queue.push(std::move(j));
+    }
+
+    queue.close();
+    for (auto& w : workers) {
+        w.join();
+    }
+    if (ec) {
+        ans.failed.emplace_back(in_dir.string(), "Can't read directory");
+    }
+    sort(ans.failed.begin(), ans.failed.end());
+    return ans;
+}
+
+} // namespace
+
+#ifndef _WITH_TESTS
+
+//----------------------------------------------------------------------------
+// Main
+
+namespace {
+
+void
+usage()
+{
+    cerr << "Usage: il2fit-tree [--jobs N] [--wrk2il PATH] [--force] IN_DIR OUT_DIR" << endl
+         << endl
+         << "Convert .wrk and .il files under IN_DIR to .fit files at the same" << endl
+         << "relative paths under OUT_DIR. Files whose output is newer than" << endl
+         << "them are skipped, and so are a .wrk and a .il file that would" << endl
+         << "make the same .fit file. Failures are listed at the end." << endl
+         << endl
+         << "  --jobs N        Convert up to N files in parallel, 0 for one per" << endl
+         << "                  CPU (default 0, at most 4 per CPU)" << endl
+         << "  --wrk2il PATH   Translate .wrk files with PATH (default wrk2il" << endl
+         << "                  next to il2fit-tree, or from PATH)" << endl
+         << "  --force         Convert all files, even if up to date" << endl;
+}
+
+// Threads for --jobs N: one per CPU for 0, and no more than 4 per CPU,
+// so that a typo or a negative number can't start thousands of them
+optional<size_t>
+parse_jobs(const string& arg)
+{
+    const size_t cpus = max(1u, thread::hardware_concurrency());
+    istringstream iss(arg);
+    size_t n;
+    if (arg.empty() || !isdigit(static_cast<unsigned char>(arg[0])) ||
+        !(iss >> n) || !iss.eof()) {
+        return nullopt;
+    }
+    return n == 0 ? cpus : min(n, 4 * cpus);
+}
+
+// wrk2il installed next to this program, as wrk2fit.sh expects it, or
+// the one on PATH
+string
+default_wrk2il(const char* argv0)
+{
+    const fs::path self(argv0);
+    if (self.has_parent_path()) {
+        const auto exe = self.parent_path() / "wrk2il";
+        error_code ec;
+        if (fs::exists(exe, ec)) {
+            return exe.string();
+        }
+    }
+    return "wrk2il";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    vector<string> dirs;
+    string wrk2il_exe = default_wrk2il(argv[0]);
+    size_t threads = 0;
+    bool force = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const string opt = argv[i];
+        if (i + 1 < argc && opt == "--jobs") {
+            const auto n = parse_jobs(argv[++i]);
+            if (!n) {
+                usage();
+                return 2;
+            }
+            threads = n.value();
+        } else if (i + 1 < argc && opt == "--wrk2il") {
+            wrk2il_exe = argv[++i];
+        } else if (opt == "--force") {
+            force = true;
+        } else if (opt.compare(0, 1, "-")) {
+            dirs.push_back(opt);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (dirs.size() != 2) {
+        usage();
+        return 2;
+    }
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+
+    error_code ec;
+    if (!fs::is_directory(dirs[0], ec)) {
+        cerr << "\"" << dirs[0] << "\" is not a directory" << endl;
+        return 1;
+    }
+
+    const auto s = convert_tree(dirs[0], dirs[1], threads, force,
+                                wrk2il_exe);
+    for (const auto& f : s.failed) {
+        cerr << f.first << ": " << f.second << endl;
+    }
+    cerr << s.converted << " converted, " << s.up_to_date
+         << " up to date, " << s.failed.size() << " failed" << endl;
+    return s.failed.empty() ? 0 : 1;
+}
+
+#else  // _WITH_TESTS
+
+//----------------------------------------------------------------------------
+// Tests
+
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+namespace {
+
+// Empty directory for a test, removed with what's in it at the end
+class temp_dir
+{
+public:
+    explicit
+    temp_dir(const string& name) :
+        path_(fs::temp_directory_path() /
+              ("il2fit-tree-test-" + std::to_string(getpid()) + "-" + name))
+    {
+        fs::remove_all(path_);
+        fs::create_directories(path_);
+    }
+
+    ~temp_dir()
+    {
+        error_code ec;
+        fs::remove_all(path_, ec);
+    }
+
+    const fs::path&
+    path() const
+    {
+        return path_;
+    }
+
+private:
+    const fs::path path_;
+};
+
+void
+write(const fs::path& path, const string& data)
+{
+    fs::create_directories(path.parent_path());
+    ofstream(path, ios::out | ios::binary | ios::trunc) << data;
+}
+
+// Files left under dir, at their relative paths
+vector<string>
+files(const fs::path& dir)
+{
+    vector<string> ans;
+    for (const auto& e : fs::recursive_directory_iterator(dir)) {
+        if (e.is_regular_file()) {
+            ans.push_back(e.path().lexically_relative(dir).string());
+        }
+    }
+    sort(ans.begin(), ans.end());
+    return ans;
+}
+
+const string il =
+    "begin\n"
+    "workout\n"
+    "wkt_name\n"
+    "Tempo\n"
+    "end\n"
+    "workout\n";
+
+} // namespace
+
+TEST_CASE("Up to date as make has it", "[up_to_date]")
+{
+    const temp_dir dir("up-to-date");
+    const job j{ dir.path() / "a.il", dir.path() / "a.fit" };
+    write(j.input, il);
+    CHECK_FALSE(up_to_date(j));
+
+    write(j.output, "");
+    const auto t = fs::last_write_time(j.input);
+    fs::last_write_time(j.output, t);
+    CHECK(up_to_date(j));
+    fs::last_write_time(j.output, t + std::chrono::seconds(1));
+    CHECK(up_to_date(j));
+    fs::last_write_time(j.output, t - std::chrono::seconds(1));
+    CHECK_FALSE(up_to_date(j));
+}
+
+TEST_CASE("Convert through a temporary file", "[convert]")
+{
+    const temp_dir dir("convert");
+    const job j{ dir.path() / "in" / "a.il",
+                 dir.path() / "out" / "x" / "a.fit" };
+    write(j.input, il);
+    const vector<string> only = { "x/a.fit" };
+    convert(j, "wrk2il");
+    CHECK(contents(j.output) == wrked::convert(il));
+    CHECK(files(dir.path() / "out") == only);
+
+    // A failure leaves the old output, and nothing next to it
+    write(j.input, "begin\nnonsense\n");
+    CHECK_THROWS_AS(convert(j, "wrk2il"), runtime_error);
+    CHECK(contents(j.output) == wrked::convert(il));
+    CHECK(files(dir.path() / "out") == only);
+}
+
+TEST_CASE("Convert a tree", "[convert_tree]")
+{
+    const temp_dir dir("tree");
+    const auto in = dir.path() / "in";
+    const auto out = dir.path() / "out";
+    write(in / "a.il", il);
+    write(in / "b" / "c.il", il);
+    write(in / "b" / "d.il", "begin\nnonsense\n");
+    write(in / "notes.txt", "");
+
+    auto s = convert_tree(in, out, 2, false, "wrk2il");
+    CHECK(s.converted == 2);
+    CHECK(s.up_to_date == 0);
+    REQUIRE(s.failed.size() == 1);
+    CHECK(s.failed[0].first == (in / "b" / "d.il").string());
+    const vector<string> fits = { "a.fit", "b/c.fit" };
+    CHECK(files(out) == fits);
+
+    s = convert_tree(in, out, 2, false, "wrk2il");
+    CHECK(s.converted == 0);
+    CHECK(s.up_to_date == 2);
+
+    s = convert_tree(in, out, 2, true, "wrk2il");
+    CHECK(s.converted == 2);
+}
+
+TEST_CASE("Inputs for the same output fail", "[convert_tree]")
+{
+    const temp_dir dir("rivals");
+    const auto in = dir.path() / "in";
+    const auto out = dir.path() / "out";
+    write(in / "a.il", il);
+    write(in / "a.wrk", "[open]");
+    write(in / "b.il", il);
+
+    // wrk2il isn't run for a.wrk, so it needn't exist
+    const auto s = convert_tree(in, out, 2, false, "no-such-wrk2il");
+    CHECK(s.converted == 1);
+    const vector<pair<string, string>> failed = {
+        { (in / "a.il").string(), "\"a.wrk\" makes the same .fit file" },
+        { (in / "a.wrk").string(), "\"a.il\" makes the same .fit file" }
+    };
+    CHECK(s.failed == failed);
+    const vector<string> fits = { "b.fit" };
+    CHECK(files(out) == fits);
+}
+
+#endif  // _WITH_TESTS
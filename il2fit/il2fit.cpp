@@ -1,50 +1,137 @@
 #include <algorithm>
-#include <experimental/optional>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cfloat>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <variant>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IL2FIT_WITH_SSE41 1
+#include <immintrin.h>
+#endif
+
+#include "alloc.hpp"
+#include "cache.hpp"
+#include "crc.hpp"
+#include "fit2il.hpp"
+#include "il2fit.hpp"
+#include "profile.hpp"
+#include "server.hpp"
+#include "table.hpp"
+#include "verify.hpp"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wignored-qualifiers"
 
 #include <fit_date_time.hpp>
+
+#if defined(_WITH_TESTS) || defined(_WITH_BENCHMARKS)
 #include <fit_encode.hpp>
 #include <fit_file_creator_mesg.hpp>
 #include <fit_file_id_mesg.hpp>
 #include <fit_workout_mesg.hpp>
 #include <fit_workout_step_mesg.hpp>
+#endif
 
 #pragma GCC diagnostic pop
 
+using std::atomic;
+using std::bad_optional_access;
+using std::bitset;
 using std::cerr;
 using std::cin;
+using std::condition_variable;
 using std::cout;
+using std::deque;
 using std::endl;
+using std::errc;
+using std::error_code;
 using std::exception;
-using std::experimental::bad_optional_access;
-using std::experimental::nullopt;
-using std::experimental::optional;
+using std::floor;
+using std::find_if_not;
+using std::from_chars;
 using std::function;
 using std::getline;
+using std::hex;
+using std::ifstream;
+using std::index_sequence;
 using std::ios;
 using std::iostream;
 using std::istream;
+using std::is_floating_point_v;
+using std::is_integral_v;
+using std::is_same_v;
+using std::is_unsigned_v;
 using std::istringstream;
+using std::lock_guard;
+using std::logic_error;
+using std::make_index_sequence;
 using std::make_pair;
 using std::max;
+using std::memcpy;
 using std::min;
+using std::mutex;
+using std::nullopt;
+using std::numeric_limits;
+using std::ofstream;
+using std::optional;
+using std::ostream;
 using std::ostringstream;
 using std::out_of_range;
 using std::pair;
+using std::remove;
 using std::runtime_error;
+using std::setfill;
+using std::setw;
+using std::size_t;
+using std::sort;
 using std::string;
+using std::string_view;
 using std::stringstream;
-using std::unordered_map;
-using std::wstring;
+using std::thread;
+using std::uint32_t;
+using std::uint64_t;
+using std::uintmax_t;
+using std::uintptr_t;
+using std::unique_lock;
+using std::variant;
+using std::vector;
+using std::visit;
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
 
 #define S(_expr)                                                   \
     static_cast<ostringstream&>(                                   \
@@ -59,17 +146,22 @@ error(const string& descr = "")
     throw runtime_error(descr);
 }
 
-string
-trim(const string& s)
+bool
+space(char c)
+{
+    return isspace(static_cast<unsigned char>(c));
+}
+
+string_view
+trim(string_view s)
 {
-    string ans = s;
     // Left
-    const auto l = find_if_not(ans.begin(), ans.end(), isspace);
-    ans.erase(ans.begin(), l);
+    const auto l = find_if_not(s.begin(), s.end(), space);
+    s.remove_prefix(l - s.begin());
     // Right
-    const auto r = find_if_not(ans.rbegin(), ans.rend(), isspace).base();
-    ans.erase(r, ans.end());
-    return ans;
+    const auto r = find_if_not(s.rbegin(), s.rend(), space);
+    s.remove_suffix(r - s.rbegin());
+    return s;
 }
 
 //----------------------------------------------------------------------------
@@ -87,6 +179,60 @@ some(const T& v)
 //----------------------------------------------------------------------------
 // Line-based input
 
+// Binary IL starts with this magic, and is a sequence of message records:
+// message number (position in il2fit()'s message list), 16-bit payload
+// length, then fields. A field is its key (position in the message's
+// field list), and a 32-bit number, or a length byte and that many bytes
+// for strings and enum names. Numbers are little-endian uint32 or
+// float32, as the field is parsed from text.
+constexpr string_view binary_magic("\x89IL1", 4);
+
+// Cursor over an IL buffer, which must outlive it. Text or binary IL
+// is told by the magic.
+struct reader
+{
+    explicit reader(string_view b) :
+        buffer(b),
+        binary(b.substr(0, binary_magic.size()) == binary_magic),
+        pos(binary ? binary_magic.size() : 0),
+        end(b.size())
+    {
+    }
+
+    // Part of a document, from one of its messages on
+    reader(string_view b, bool bin) :
+        buffer(b),
+        binary(bin),
+        pos(0),
+        end(b.size())
+    {
+    }
+
+    string_view buffer;
+    bool binary;
+    size_t pos;
+    size_t end;                 // End of the current binary record
+    size_t tokens = 0;          // Lines or binary fields read so far
+    size_t line = 0;            // Text lines read so far
+    size_t block = 0;           // Messages started so far
+    optional<size_t> mesg;      // The one being read, once it's known
+};
+
+optional<string_view>
+line(reader& input)
+{
+    const auto& b = input.buffer;
+    if (input.pos >= b.size()) {
+        return none;
+    }
+    const auto eol = min(b.find('\n', input.pos), b.size());
+    const auto ans = b.substr(input.pos, eol - input.pos);
+    input.pos = eol + 1;
+    ++input.tokens;
+    ++input.line;
+    return some(ans);
+}
+
 optional<string>
 line(istream& input)
 {
@@ -101,17 +247,415 @@ line(istream& input)
     return some(ans);
 }
 
+string
+contents(istream& input)
+{
+    string ans;
+    char buf[1 << 16];
+    while (input.read(buf, sizeof(buf)) || input.gcount() > 0) {
+        ans.append(buf, input.gcount());
+    }
+    if (input.bad()) {
+        error("I/O error");
+    }
+    return ans;
+}
+
+//----------------------------------------------------------------------------
+// Whole IL input in memory
+
+// File, or stdin for an empty path or "-". Regular files are mapped and
+// parsed in place, anything else is read into a buffer.
+class il_file
+{
+public:
+    explicit
+    il_file(const string& path)
+    {
+        const bool std_in = path.empty() || path == "-";
+#ifndef _WIN32
+        const int fd = std_in ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error("Can't read \"" + path + "\"");
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            lseek(fd, 0, SEEK_CUR) == 0) {
+            const auto size = static_cast<size_t>(st.st_size);
+            const auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, size, MADV_SEQUENTIAL);
+                map_ = p;
+                data_ = string_view(static_cast<const char*>(p), size);
+            }
+        }
+        if (!std_in) {
+            close(fd);
+        }
+        if (map_) {
+            return;
+        }
+#endif
+        if (std_in) {
+            buffer_ = contents(cin);
+        } else {
+            ifstream file(path, ios::in | ios::binary);
+            if (!file) {
+                error("Can't read \"" + path + "\"");
+            }
+            buffer_ = contents(file);
+        }
+        data_ = buffer_;
+    }
+
+    il_file(const il_file&) = delete;
+    il_file& operator=(const il_file&) = delete;
+
+    ~il_file()
+    {
+#ifndef _WIN32
+        if (map_) {
+            munmap(map_, data_.size());
+        }
+#endif
+    }
+
+    string_view
+    data() const
+    {
+        return data_;
+    }
+
+private:
+    void* map_ = nullptr;
+    string buffer_;
+    string_view data_;
+};
+
+//----------------------------------------------------------------------------
+// Binary input
+
+unsigned
+octet(char c)
+{
+    return static_cast<unsigned char>(c);
+}
+
+string_view
+bytes(reader& input, size_t n)
+{
+    if (n > input.end - input.pos) {
+        error("Unexpected end of record");
+    }
+    const auto ans = input.buffer.substr(input.pos, n);
+    input.pos += n;
+    return ans;
+}
+
+// Fixed-width binary number
+template <class T>
+T
+fixed(reader& input)
+{
+    const auto b = bytes(input, 4);
+    const uint32_t u = octet(b[0]) | octet(b[1]) << 8 |
+        octet(b[2]) << 16 | uint32_t(octet(b[3])) << 24;
+    if constexpr (is_floating_point_v<T>) {
+        float ans;
+        static_assert(sizeof(ans) == sizeof(u), "No float32");
+        memcpy(&ans, &u, sizeof(ans));
+        return ans;
+    } else {
+        if constexpr (sizeof(T) < sizeof(u)) {
+            if (u > numeric_limits<T>::max()) {
+                error(S("Value " << u << " is out of range"));
+            }
+        }
+        return static_cast<T>(u);
+    }
+}
+
+// Start a binary record: message number and payload length
+pair<unsigned, size_t>
+record(reader& input)
+{
+    const auto h = bytes(input, 3);
+    const size_t n = octet(h[1]) | octet(h[2]) << 8;
+    if (n > input.buffer.size() - input.pos) {
+        error("Unexpected end of file");
+    }
+    input.end = input.pos + n;
+    return make_pair(octet(h[0]), n);
+}
+
+//----------------------------------------------------------------------------
+// Decimal digits
+
+// Value of 1 to 16 decimal digits, none for anything else. The vector
+// versions may load up to 16 bytes from s.data() when avail, the bytes
+// readable there, says they're in the buffer; the scalar ones ignore it.
+optional<uint64_t>
+digits_scalar(string_view s, size_t = 0)
+{
+    if (s.empty() || s.size() > 16) {
+        return none;
+    }
+    uint64_t ans = 0;
+    for (const auto c : s) {
+        const auto d = octet(c) - '0';
+        if (d > 9) {
+            return none;
+        }
+        ans = ans * 10 + d;
+    }
+    return ans;
+}
+
+// Number of up to 16 characters, digits with at most one decimal point:
+// the digits as an integer, and how many of them follow the point
+struct decimal
+{
+    uint64_t digits;
+    unsigned places;
+};
+
+optional<decimal>
+decimal_scalar(string_view s, size_t = 0)
+{
+    if (s.empty() || s.size() > 16 || s == ".") {
+        return none;
+    }
+    decimal ans = { 0, 0 };
+    auto dot = string_view::npos;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const auto d = octet(s[i]) - '0';
+        if (d <= 9) {
+            ans.digits = ans.digits * 10 + d;
+        } else if (s[i] == '.' && dot == string_view::npos) {
+            dot = i;
+        } else {
+            return none;
+        }
+    }
+    if (dot != string_view::npos) {
+        ans.places = static_cast<unsigned>(s.size() - dot - 1);
+    }
+    return ans;
+}
+
+#ifdef IL2FIT_WITH_SSE41
+
+#define SSE41_TARGET __attribute__((target("sse4.1")))
+
+// Shuffles that move n bytes from the start of a register to its end,
+// zeroing the bytes before them
+struct align_right_tables
+{
+    constexpr
+    align_right_tables() :
+        t()
+    {
+        for (int n = 0; n <= 16; ++n) {
+            for (int i = 0; i < 16; ++i) {
+                t[n][i] = i < 16 - n ? '\x80' : static_cast<char>(i - (16 - n));
+            }
+        }
+    }
+
+    alignas(16) char t[17][16];
+};
+
+constexpr align_right_tables align_right;
+
+// The token is loaded in place when the 16 bytes are all in its buffer,
+// as they are for all but the last few tokens of an input, and copied
+// otherwise
+SSE41_TARGET
+__m128i
+load16(string_view s, size_t avail)
+{
+    if (avail >= 16) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(s.data()));
+    }
+    char buf[16] = {};
+    memcpy(buf, s.data(), s.size());
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+}
+
+// Value of 16 digits, one in each byte, most significant first. They
+// are combined in pairs, fours and eights.
+SSE41_TARGET
+uint64_t
+combine16(__m128i d)
+{
+    const auto pairs = _mm_maddubs_epi16(
+        d, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1,
+                         10, 1, 10, 1, 10, 1, 10, 1));
+    const auto fours = _mm_madd_epi16(
+        pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    const auto eights = _mm_madd_epi16(
+        _mm_packus_epi32(fours, fours),
+        _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+    const uint64_t hi = static_cast<uint32_t>(_mm_cvtsi128_si32(eights));
+    const uint64_t lo = static_cast<uint32_t>(_mm_extract_epi32(eights, 1));
+    return hi * 100000000 + lo;
+}
+
+SSE41_TARGET
+optional<uint64_t>
+digits_sse41(string_view s, size_t avail = 0)
+{
+    const auto n = s.size();
+    if (n == 0 || n > 16) {
+        return none;
+    }
+    const auto v = _mm_sub_epi8(load16(s, avail), _mm_set1_epi8('0'));
+    const auto digit = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v);
+    const unsigned want = (1u << n) - 1;
+    if ((_mm_movemask_epi8(digit) & want) != want) {
+        return none;
+    }
+    return combine16(_mm_shuffle_epi8(
+        v, _mm_load_si128(reinterpret_cast<const __m128i*>(align_right.t[n]))));
+}
+
+// All characters are classified at once. The digits are moved to the
+// end of the register, and the ones before the point one further, over
+// it, so that they're all together.
+SSE41_TARGET
+optional<decimal>
+decimal_sse41(string_view s, size_t avail = 0)
+{
+    const auto n = s.size();
+    if (n == 0 || n > 16) {
+        return none;
+    }
+    const auto raw = load16(s, avail);
+    const auto v = _mm_sub_epi8(raw, _mm_set1_epi8('0'));
+    const auto digit = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v);
+    const unsigned want = (1u << n) - 1;
+    const unsigned digits = _mm_movemask_epi8(digit) & want;
+    const unsigned dots =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(raw, _mm_set1_epi8('.'))) & want;
+    if ((digits | dots) != want || (dots & (dots - 1)) || digits == 0) {
+        return none;
+    }
+
+    auto d = _mm_shuffle_epi8(
+        v, _mm_load_si128(reinterpret_cast<const __m128i*>(align_right.t[n])));
+    unsigned places = 0;
+    if (dots) {
+        const unsigned p = __builtin_ctz(dots);
+        const auto q = static_cast<char>(16 - n + p); // Point, aligned
+        places = static_cast<unsigned>(n - p - 1);
+        const auto before = _mm_cmpgt_epi8(
+            _mm_set1_epi8(static_cast<char>(q + 1)),
+            _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                          8, 9, 10, 11, 12, 13, 14, 15));
+        d = _mm_blendv_epi8(d, _mm_slli_si128(d, 1), before);
+    }
+    return decimal{ combine16(d), places };
+}
+
+#endif  // IL2FIT_WITH_SSE41
+
+bool
+have_sse41()
+{
+#ifdef IL2FIT_WITH_SSE41
+    __builtin_cpu_init();       // May run before libgcc's constructors
+    return __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
+
+// Picked once, as checking the CPU on every call costs more than the
+// vector code saves on short numbers
+#ifdef IL2FIT_WITH_SSE41
+const auto digits = have_sse41() ? digits_sse41 : digits_scalar;
+const auto decimal_of = have_sse41() ? decimal_sse41 : decimal_scalar;
+#else
+const auto digits = digits_scalar;
+const auto decimal_of = decimal_scalar;
+#endif
+
+// Float of a decimal when it comes out exact: the digits fit the 24-bit
+// mantissa and the power of ten is exact too, so one correctly rounded
+// division gives what from_chars() does. None for anything else.
+optional<float>
+decimal_float(string_view s, size_t avail = 0)
+{
+    static constexpr float powers[] = {
+        1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+    };
+
+    if constexpr (FLT_EVAL_METHOD != 0) {
+        return none;
+    }
+    const auto d = decimal_of(s, avail);
+    if (!d || d->digits > (uint64_t(1) << 24) ||
+        d->places >= std::size(powers)) {
+        return none;
+    }
+    return static_cast<float>(d->digits) / powers[d->places];
+}
+
+//----------------------------------------------------------------------------
+// Parse value from token
+
+// Unsigned numbers and plain decimal floats take the fast path, anything
+// else, errors included, goes through from_chars(). avail is the bytes
+// readable from the start of the token, at least its size.
+template <class T>
+T
+parse(string_view token, size_t avail = 0)
+{
+    const size_t plus = token.substr(0, 1) == "+";
+    const auto first = token.data() + plus;
+    const auto last = token.data() + token.size();
+    avail = max(avail, token.size()) - plus;
+    if constexpr (is_integral_v<T> && is_unsigned_v<T> &&
+                  !is_same_v<T, bool>) {
+        // from_chars() is as quick on short ones
+        if (last - first >= 4) {
+            const auto n = digits(string_view(first, last - first), avail);
+            if (n && *n <= numeric_limits<T>::max()) {
+                return static_cast<T>(*n);
+            }
+        }
+    } else if constexpr (is_same_v<T, float>) {
+        if (const auto x = decimal_float(string_view(first, last - first),
+                                         avail)) {
+            return *x;
+        }
+    }
+    T ans;
+    const auto r = from_chars(first, last, ans);
+    if (r.ec != errc() || r.ptr != last) {
+        error("Bad syntax near \"" + string(token) + "\"");
+    }
+    return ans;
+}
+
 //----------------------------------------------------------------------------
 // Parse value from input
 
+template <class T>
+T
+value(reader& input);
+
 template <class T>
 T
 value(istream& input);
 
 template <>
-string
-value<string>(istream& input)
+string_view
+value<string_view>(reader& input)
 {
+    if (input.binary) {
+        return bytes(input, octet(bytes(input, 1)[0]));
+    }
     try {
         return trim(line(input).value());
     } catch (const bad_optional_access&) {
@@ -120,34 +664,41 @@ value<string>(istream& input)
 }
 
 template <>
-wstring
-value<wstring>(istream& input)
+string
+value<string>(istream& input)
+{
+    try {
+        return string(trim(line(input).value()));
+    } catch (const bad_optional_access&) {
+        error("Unexpected end of file");
+    }
+}
+
+template <class T>
+T
+value(reader& input)
 {
-    // FIXME: Invalid conversion
-    const auto s = value<string>(input);
-    return wstring(s.begin(), s.end());
+    if (input.binary) {
+        return fixed<T>(input);
+    }
+    const auto token = value<string_view>(input);
+    const auto& b = input.buffer;
+    return parse<T>(token, size_t(b.data() + b.size() - token.data()));
 }
 
 template <class T>
 T
 value(istream& input)
 {
-    const auto k = value<string>(input);
-    T ans;
-    istringstream iss(k);
-    iss >> ans;
-    if (iss.fail()) {
-        error("Bad syntax near \"" + k + "\"");
-    }
-    return ans;
+    return parse<T>(value<string>(input));
 }
 
 //----------------------------------------------------------------------------
 // Parse value from input and check range
 
-template <class T>
+template <class T, class Input>
 T
-value(istream& input, const T& a, const T& b)
+value(Input& input, const T& a, const T& b)
 {
     const auto p = min(a, b);
     const auto q = max(a, b);
@@ -159,9 +710,9 @@ value(istream& input, const T& a, const T& b)
     return ans;
 }
 
-template <class T>
+template <class T, class Input>
 T
-value(istream& input, const pair<T, T>& range)
+value(Input& input, const pair<T, T>& range)
 {
     return value<T>(input, range.first, range.second);
 }
@@ -169,722 +720,4285 @@ value(istream& input, const pair<T, T>& range)
 //----------------------------------------------------------------------------
 // Parse enum value from input
 
-template <class T>
+template <class T, size_t N>
 T
-value(istream& input, const unordered_map<string, T>& table)
+value(reader& input, const table<T, N>& table)
 {
-    const auto token = value<string>(input);
-    try {
-        return table.at(token);
-    } catch (const out_of_range&) {
-        error("Invalid enum value \"" + token + "\"");
+    const auto t = value<string_view>(input);
+    if (const auto ans = table.find(t)) {
+        return *ans;
     }
+    error("Invalid enum value \"" + string(t) + "\"");
 }
 
 //----------------------------------------------------------------------------
-// Call actions on input tokens
+// Match input tokens against keywords
 
-void
-match(const string& token,
-      const unordered_map<string, function<void()> >& actions)
+template <size_t N>
+size_t
+match(string_view token, const table<size_t, N>& keywords)
 {
-    try {
-        actions.at(token)();
-    } catch (const out_of_range&) {
-        error("Bad token \"" + token + "\"");
+    if (const auto ans = keywords.find(token)) {
+        return *ans;
+    }
+    error("Bad token \"" + string(token) + "\"");
+}
+
+// Binary fields are matched by key, the record ends with "end"
+template <size_t N>
+size_t
+match(reader& input, const table<size_t, N>& keywords)
+{
+    if (input.binary) {
+        if (input.pos == input.end) {
+            return keywords["end"];
+        }
+        const auto k = octet(bytes(input, 1)[0]);
+        if (k >= N) {
+            error(S("Bad field " << k));
+        }
+        ++input.tokens;
+        return k;
     }
+    return match(value<string_view>(input), keywords);
 }
 
 void
-match(istream& input,
-      const unordered_map<string, function<void()> >& actions)
+expect(reader& input, string_view keyword)
 {
-    match(value<string>(input), actions);
+    if (input.binary) {
+        if (input.pos != input.end) {
+            error("Bad record");
+        }
+        input.end = input.buffer.size();
+        return;
+    }
+    const auto t = value<string_view>(input);
+    if (t != keyword) {
+        error("Bad token \"" + string(t) + "\"");
+    }
 }
 
 //----------------------------------------------------------------------------
-// Parse FIT messages from input
+// FIT messages
 
-template <>
-fit::FileCreatorMesg
-value<fit::FileCreatorMesg>(istream& input)
-{
-    fit::FileCreatorMesg ans;
-
-    for (bool done = false; !done;) {
-        match(input, {
-                { "hardware_version", [&] {
-                        ans.SetHardwareVersion(value<FIT_UINT8>(input)); }},
-                { "software_version", [&] {
-                        ans.SetSoftwareVersion(value<FIT_UINT16>(input)); }},
-                { "end", [&] {
-                        match(input, {
-                                { "file_creator", [&] { done = true; }} });
-                    }}
-            });
+template <size_t N>
+constexpr bool
+slotted(const field_def (&defs)[N])
+{
+    for (size_t i = 0; i < N; ++i) {
+        if (defs[i].slot != i) {
+            return false;
+        }
     }
-
-    return ans;
+    return true;
 }
 
-template <>
-fit::FileIdMesg
-value<fit::FileIdMesg>(istream& input)
+// Field value. Numbers are stored as they are encoded, i.e. already
+// scaled for the field or subfield.
+struct field
 {
-    fit::FileIdMesg ans;
+    FIT_UINT8 num;
+    FIT_UINT8 type;
+    FIT_UINT8 slot;
+    FIT_UINT32 number;
+    string_view text;
+};
 
-    // Default values
-    ans.SetType(FIT_FILE_WORKOUT);
-    ans.SetManufacturer(FIT_MANUFACTURER_GARMIN);
-    ans.SetProduct(FIT_GARMIN_PRODUCT_EDGE500);
-    ans.SetSerialNumber(54321);
-    ans.SetTimeCreated(
-        fit::DateTime(static_cast<time_t>(1454942443)).GetTimeStamp());
+// Message with the fields of Defs, kept in the order they were first
+// set, which is the order fit::Mesg defines and writes them in. Fields
+// are found by slot, without a search.
+template <FIT_UINT16 Num, const auto& Defs>
+class mesg
+{
+public:
+    static constexpr FIT_UINT16 num = Num;
+    static constexpr size_t size = std::size(Defs);
 
-    for (bool done = false; !done;) {
-        match(input, {
-                { "number", [&] {
-                        ans.SetNumber(value<FIT_UINT16>(input)); } },
-                { "serial_number", [&] {
-                        ans.SetSerialNumber(value<FIT_UINT32Z>(input)); } },
-                { "time_created", [&] {
-                        ans.SetTimeCreated(value<FIT_DATE_TIME>(input)); } },
-                { "end", [&] {
-                        match(input, {
-                                { "file_id", [&] { done = true; }} });
-                    }}
-            });
-    }
+    static_assert(slotted(Defs), "Fields must be listed by slot");
 
-    return ans;
-}
+    void
+    set(field_def def, FIT_UINT32 number)
+    {
+        at(def).number = number;
+    }
 
-template <>
-fit::WorkoutMesg
-value<fit::WorkoutMesg>(istream& input)
-{
-    static const unordered_map<string, FIT_SPORT> sports = {
-        { "generic"                 , FIT_SPORT_GENERIC                 },
-        { "running"                 , FIT_SPORT_RUNNING                 },
-        { "cycling"                 , FIT_SPORT_CYCLING                 },
-        { "transition"              , FIT_SPORT_TRANSITION              },
-        { "fitness_equipment"       , FIT_SPORT_FITNESS_EQUIPMENT       },
-        { "swimming"                , FIT_SPORT_SWIMMING                },
-        { "basketball"              , FIT_SPORT_BASKETBALL              },
-        { "soccer"                  , FIT_SPORT_SOCCER                  },
-        { "tennis"                  , FIT_SPORT_TENNIS                  },
-        { "american_football"       , FIT_SPORT_AMERICAN_FOOTBALL       },
-        { "training"                , FIT_SPORT_TRAINING                },
-        { "walking"                 , FIT_SPORT_WALKING                 },
-        { "cross_country_skiing"    , FIT_SPORT_CROSS_COUNTRY_SKIING    },
-        { "alpine_skiing"           , FIT_SPORT_ALPINE_SKIING           },
-        { "snowboarding"            , FIT_SPORT_SNOWBOARDING            },
-        { "rowing"                  , FIT_SPORT_ROWING                  },
-        { "mountaineering"          , FIT_SPORT_MOUNTAINEERING          },
-        { "hiking"                  , FIT_SPORT_HIKING                  },
-        { "multisport"              , FIT_SPORT_MULTISPORT              },
-        { "paddling"                , FIT_SPORT_PADDLING                },
-        { "flying"                  , FIT_SPORT_FLYING                  },
-        { "e_biking"                , FIT_SPORT_E_BIKING                },
-        { "motorcycling"            , FIT_SPORT_MOTORCYCLING            },
-        { "boating"                 , FIT_SPORT_BOATING                 },
-        { "driving"                 , FIT_SPORT_DRIVING                 },
-        { "golf"                    , FIT_SPORT_GOLF                    },
-        { "hang_gliding"            , FIT_SPORT_HANG_GLIDING            },
-        { "horseback_riding"        , FIT_SPORT_HORSEBACK_RIDING        },
-        { "hunting"                 , FIT_SPORT_HUNTING                 },
-        { "fishing"                 , FIT_SPORT_FISHING                 },
-        { "inline_skating"          , FIT_SPORT_INLINE_SKATING          },
-        { "rock_climbing"           , FIT_SPORT_ROCK_CLIMBING           },
-        { "sailing"                 , FIT_SPORT_SAILING                 },
-        { "ice_skating"             , FIT_SPORT_ICE_SKATING             },
-        { "sky_diving"              , FIT_SPORT_SKY_DIVING              },
-        { "snowshoeing"             , FIT_SPORT_SNOWSHOEING             },
-        { "snowmobiling"            , FIT_SPORT_SNOWMOBILING            },
-        { "stand_up_paddleboarding" , FIT_SPORT_STAND_UP_PADDLEBOARDING },
-        { "surfing"                 , FIT_SPORT_SURFING                 },
-        { "wakeboarding"            , FIT_SPORT_WAKEBOARDING            },
-        { "water_skiing"            , FIT_SPORT_WATER_SKIING            },
-        { "kayaking"                , FIT_SPORT_KAYAKING                },
-        { "rafting"                 , FIT_SPORT_RAFTING                 },
-        { "windsurfing"             , FIT_SPORT_WINDSURFING             },
-        { "kitesurfing"             , FIT_SPORT_KITESURFING             }
-    };
+    void
+    set(field_def def, string_view text)
+    {
+        at(def).text = text;
+    }
 
-    fit::WorkoutMesg ans;
+    // Field at a slot, if it's set
+    const field*
+    get(size_t slot) const
+    {
+        return index_[slot] ? &fields_[index_[slot] - 1] : nullptr;
+    }
 
-    // Default values
-    ans.SetSport(FIT_SPORT_CYCLING);
-    ans.SetCapabilities(FIT_WORKOUT_CAPABILITIES_INVALID);
-    ans.SetNumValidSteps(1);
-
-    for (bool done = false; !done;) {
-        match(input, {
-                { "capabilities", [&] {
-                        ans.SetCapabilities(
-                            value<FIT_WORKOUT_CAPABILITIES>(input)); } },
-                { "num_valid_steps", [&] {
-                        ans.SetNumValidSteps(
-                            value<FIT_UINT16>(input, 1, 10000)); } },
-                { "sport", [&] {
-                        ans.SetSport(value<FIT_SPORT>(input, sports)); } },
-                { "wkt_name", [&] {
-                        ans.SetWktName(value<FIT_WSTRING>(input)); } },
-                { "end", [&] {
-                        match(input, {
-                                { "workout", [&] { done = true; }} });
-                    }}
-            });
+    const field*
+    begin() const
+    {
+        return fields_;
     }
 
-    return ans;
-}
+    const field*
+    end() const
+    {
+        return fields_ + count_;
+    }
 
-template <>
-fit::WorkoutStepMesg
-value<fit::WorkoutStepMesg>(istream& input)
-{
-    static const unordered_map<string, FIT_INTENSITY> intensities = {
-        { "active"   , FIT_INTENSITY_ACTIVE   },
-        { "rest"     , FIT_INTENSITY_REST     },
-        { "warmup"   , FIT_INTENSITY_WARMUP   },
-        { "cooldown" , FIT_INTENSITY_COOLDOWN }
-    };
+private:
+    field&
+    at(field_def def)
+    {
+        auto& i = index_[def.slot];
+        if (!i) {
+            fields_[count_] = { def.num, def.type, def.slot, 0, {} };
+            i = static_cast<unsigned char>(++count_);
+        }
+        return fields_[i - 1];
+    }
 
-    static const unordered_map<string, FIT_WKT_STEP_DURATION> duration_types = {
-        { "time"                            , FIT_WKT_STEP_DURATION_TIME                            },
-        { "distance"                        , FIT_WKT_STEP_DURATION_DISTANCE                        },
-        { "hr_less_than"                    , FIT_WKT_STEP_DURATION_HR_LESS_THAN                    },
-        { "hr_greater_than"                 , FIT_WKT_STEP_DURATION_HR_GREATER_THAN                 },
-        { "colories"                        , FIT_WKT_STEP_DURATION_CALORIES                        },
-        { "open"                            , FIT_WKT_STEP_DURATION_OPEN                            },
-        { "repeat_until_steps_cmplt"        , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_STEPS_CMPLT        },
-        { "repeat_until_time"               , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_TIME               },
-        { "repeat_until_distance"           , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_DISTANCE           },
-        { "repeat_until_calories"           , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_CALORIES           },
-        { "repeat_until_hr_less_than"       , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_LESS_THAN       },
-        { "repeat_until_hr_greater_than"    , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_GREATER_THAN    },
-        { "repeat_until_power_less_than"    , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_LESS_THAN    },
-        { "repeat_until_power_greater_than" , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_GREATER_THAN },
-        { "power_less_than"                 , FIT_WKT_STEP_DURATION_POWER_LESS_THAN                 },
-        { "power_greater_than"              , FIT_WKT_STEP_DURATION_POWER_GREATER_THAN              },
-        { "repetition_time"                 , FIT_WKT_STEP_DURATION_REPETITION_TIME                 }
-    };
+    field fields_[size] = {};
+    unsigned char index_[size] = {}; // Position in fields_ + 1, 0 if unset
+    size_t count_ = 0;
+};
 
-    static const unordered_map<string, FIT_WKT_STEP_TARGET> target_types = {
-        { "speed"      , FIT_WKT_STEP_TARGET_SPEED      },
-        { "heart_rate" , FIT_WKT_STEP_TARGET_HEART_RATE },
-        { "open"       , FIT_WKT_STEP_TARGET_OPEN       },
-        { "cadence"    , FIT_WKT_STEP_TARGET_CADENCE    },
-        { "power"      , FIT_WKT_STEP_TARGET_POWER      },
-        { "grade"      , FIT_WKT_STEP_TARGET_GRADE      },
-        { "resistance" , FIT_WKT_STEP_TARGET_RESISTANCE }
-    };
+// Encoded value of a scaled field, rounded the way the SDK does it.
+// Values that round below 0 are errors; fit::Encode wrapped them around
+// to huge unsigned ones.
+FIT_UINT32
+scaled(FIT_FLOAT32 value, double scale)
+{
+    const auto ans = floor(static_cast<double>(value) * scale + 0.5);
+    if (!(ans >= 0 && ans < 0xFFFFFFFF)) {
+        error(S("Value " << value << " is out of range"));
+    }
+    return static_cast<FIT_UINT32>(ans);
+}
 
-    static const pair<FIT_WORKOUT_HR, FIT_WORKOUT_HR> hr_range =
-        make_pair(0, 355);
+// Readers of IL values, encoded for their FIT fields
 
-    static const pair<FIT_WORKOUT_POWER, FIT_WORKOUT_POWER> power_range =
-        make_pair(0, 11000);
+template <class T>
+FIT_UINT32
+read_number(reader& input)
+{
+    return value<T>(input);
+}
 
-    fit::WorkoutStepMesg ans;
+template <class T, T Lo, T Hi>
+FIT_UINT32
+read_range(reader& input)
+{
+    return value<T>(input, Lo, Hi);
+}
 
-    // Default values
-    ans.SetMessageIndex(FIT_MESSAGE_INDEX_INVALID);
-    ans.SetDurationType(FIT_WKT_STEP_DURATION_OPEN);
-    ans.SetTargetType(FIT_WKT_STEP_TARGET_OPEN);
-
-    for (bool done = false; !done;) {
-        match(input, {
-                { "custom_target_cadence_high", [&] {
-                        ans.SetCustomTargetCadenceHigh(
-                            value<FIT_UINT32>(input)); // rpm
-                    } },
-                { "custom_target_cadence_low", [&] {
-                        ans.SetCustomTargetCadenceLow(
-                            value<FIT_UINT32>(input)); // rpm
-                    } },
-                { "custom_target_heart_rate_high", [&] {
-                        ans.SetCustomTargetHeartRateHigh(
-                            value(input, hr_range)); // % or bpm
-                    } },
-                { "custom_target_heart_rate_low", [&] {
-                        ans.SetCustomTargetHeartRateLow(
-                            value(input, hr_range)); // % or bpm
-                    } },
-                { "custom_target_power_high", [&] {
-                        ans.SetCustomTargetPowerHigh(
-                            value(input, power_range)); // % or W
-                    } },
-                { "custom_target_power_low", [&] {
-                        ans.SetCustomTargetPowerLow(
-                            value(input, power_range)); // % or W
-                    } },
-                { "custom_target_speed_high", [&] {
-                        ans.SetCustomTargetSpeedHigh(
-                            value<FIT_FLOAT32>(input)); // m/s
-                    } },
-                { "custom_target_speed_low", [&] {
-                        ans.SetCustomTargetSpeedLow(
-                            value<FIT_FLOAT32>(input)); // m/s
-                    } },
-                { "custom_target_value_high", [&] {
-                        ans.SetCustomTargetValueHigh(value<FIT_UINT32>(input));
-                    } },
-                { "custom_target_value_low", [&] {
-                        ans.SetCustomTargetValueLow(value<FIT_UINT32>(input));
-                    } },
-                { "duration_calories", [&] {
-                        // TODO: restrict by range?
-                        ans.SetDurationCalories(
-                            value<FIT_UINT32>(input)); // kcal
-                    } },
-                { "duration_distance", [&] {
-                        // TODO: restrict by range?
-                        ans.SetDurationDistance(value<FIT_FLOAT32>(input)); // m
-                    } },
-                { "duration_hr", [&] {
-                        ans.SetDurationHr(value(input, hr_range)); // % or bpm
-                    } },
-                { "duration_power", [&] {
-                        ans.SetDurationPower(
-                            value(input, power_range)); // % or W
-                    } },
-                { "duration_step", [&] {
-                        ans.SetDurationStep(value<FIT_UINT32>(input));
-                    } },
-                { "duration_time", [&] {
-                        // TODO: restrict by range?
-                        ans.SetDurationTime(value<FIT_FLOAT32>(input)); // s
-                    } },
-                { "duration_type", [&] {
-                        ans.SetDurationType(value(input, duration_types));
-                    } },
-                { "duration_value", [&] {
-                        ans.SetDurationValue(value<FIT_UINT32>(input));
-                    } },
-                { "intensity", [&] {
-                        ans.SetIntensity(value(input, intensities));
-                    } },
-                { "message_index", [&] {
-                        ans.SetMessageIndex(
-                            value<FIT_MESSAGE_INDEX>(input, 0, 0xFFF));
-                    } },
-                { "repeat_calories", [&] {
-                        // TODO: restrict by range?
-                        ans.SetRepeatCalories(value<FIT_UINT32>(input)); // kcal
-                    } },
-                { "repeat_distance", [&] {
-                        // TODO: restrict by range?
-                        ans.SetRepeatDistance(value<FIT_FLOAT32>(input)); // m
-                    } },
-                { "repeat_hr", [&] {
-                        ans.SetRepeatHr(value(input, hr_range)); // % or bpm
-                    } },
-                { "repeat_power", [&] {
-                        ans.SetRepeatPower(value(input, power_range)); // % or W
-                    } },
-                { "repeat_steps", [&] {
-                        ans.SetRepeatSteps(value<FIT_UINT32>(input, 1, 1000));
-                    } },
-                { "repeat_time", [&] {
-                        // TODO: restrict by range?
-                        ans.SetRepeatTime(value<FIT_FLOAT32>(input)); // s
-                    } },
-                { "target_hr_zone", [&] {
-                        // HR Zone (1-5); Custom = 0;
-                        ans.SetTargetHrZone(value<FIT_UINT32>(input, 0, 5));
-                    } },
-                { "target_power_zone", [&] {
-                        // Power Zone (1-7); Custom = 0;
-                        ans.SetTargetPowerZone(value<FIT_UINT32>(input, 0, 7));
-                    } },
-                { "target_type", [&] {
-                        ans.SetTargetType(value(input, target_types));
-                    } },
-                { "target_value", [&] {
-                        ans.SetTargetValue(value<FIT_UINT32>(input));
-                    } },
-                { "wkt_step_name", [&] {
-                        ans.SetWktStepName(value<FIT_WSTRING>(input));
-                    } },
-                { "end", [&] {
-                        match(input, {
-                                { "workout_step", [&] { done = true; }} });
-                    }}
-            });
-    }
+template <unsigned Scale>
+FIT_UINT32
+read_scaled(reader& input)
+{
+    return scaled(value<FIT_FLOAT32>(input), Scale);
+}
 
-    return ans;
+template <const auto& Table>
+FIT_UINT32
+read_enum(reader& input)
+{
+    return value(input, Table);
 }
 
-void
-il2fit(istream& input, iostream& output)
+// IL key of a message: the field it sets, and how its value is read.
+// Strings have no reader.
+struct il_key
 {
-    fit::Encode encode(fit::ProtocolVersion::V10);
+    string_view name;
+    field_def def;
+    FIT_UINT32 (*read)(reader&);
+};
 
-    encode.Open(output);
+// Keywords for the keys, in order, and "end" after them. Binary IL
+// refers to keys by these positions. Plain names are table.hpp's.
+using ::keywords;
 
-    bool empty = true;
+template <size_t N>
+constexpr table<size_t, N + 1>
+keywords(const il_key (&keys)[N])
+{
+    keyword<size_t> entries[N + 1] = {};
+    for (size_t i = 0; i < N; ++i) {
+        entries[i] = { keys[i].name, i };
+    }
+    entries[N] = { "end", N };
+    return table<size_t, N + 1>(entries);
+}
 
-    while (const auto lopt = line(input)) {
-        bool eof = false;
-
-        match(lopt.value(), {
-                { "begin", [&] {
-                        match(input, {
-                                { "file_creator", [&] {
-                                        encode.Write(value<fit::FileCreatorMesg>(input));
-                                        empty = false; }},
-                                { "file_id", [&] {
-                                        encode.Write(value<fit::FileIdMesg>(input));
-                                        empty = false; }},
-                                { "workout", [&] {
-                                        encode.Write(value<fit::WorkoutMesg>(input));
-                                        empty = false; }},
-                                { "workout_step", [&] {
-                                        encode.Write(value<fit::WorkoutStepMesg>(input));
-                                        empty = false; }}
-                            });
-                    }},
-                { "EOF", [&] { eof = true; }}
-            });
+} // namespace
 
-        if (eof) {
-            break;
-        }
-    }
+// Keys of the messages, beside their fields in profile.hpp
 
-    if (empty) {
-        error("No messages in the FIT file");
-    }
+namespace file_creator {
 
-    if (!encode.Close()) {
-        error("FIT encoder failed");
-    }
-}
+constexpr il_key keys[] = {
+    { "hardware_version" , hardware_version , read_number<FIT_UINT8>  },
+    { "software_version" , software_version , read_number<FIT_UINT16> }
+};
+} // namespace file_creator
 
-} // namespace
+namespace file_id {
 
-//----------------------------------------------------------------------------
-// Main
+constexpr il_key keys[] = {
+    { "number"        , number        , read_number<FIT_UINT16>    },
+    { "serial_number" , serial_number , read_number<FIT_UINT32Z>   },
+    { "time_created"  , time_created  , read_number<FIT_DATE_TIME> }
+};
+} // namespace file_id
 
-#ifndef _WITH_TESTS
+namespace workout {
 
-int main()
-{
-    stringstream output(ios::out | ios::binary);
+constexpr il_key keys[] = {
+    { "capabilities"    , capabilities    , read_number<FIT_WORKOUT_CAPABILITIES> },
+    { "num_valid_steps" , num_valid_steps , read_range<FIT_UINT16, 1, 10000>      },
+    { "sport"           , sport           , read_enum<sports>                     },
+    { "wkt_name"        , wkt_name        , nullptr                               }
+};
+} // namespace workout
+
+namespace workout_step {
+
+// % or bpm
+constexpr auto read_hr = read_range<FIT_WORKOUT_HR, 0, 355>;
+// % or W
+constexpr auto read_power = read_range<FIT_WORKOUT_POWER, 0, 11000>;
+
+// TODO: restrict calories, distances and times by range?
+constexpr il_key keys[] = {
+    { "custom_target_cadence_high"    , custom_target_value_high , read_number<FIT_UINT32>                    }, // rpm
+    { "custom_target_cadence_low"     , custom_target_value_low  , read_number<FIT_UINT32>                    }, // rpm
+    { "custom_target_heart_rate_high" , custom_target_value_high , read_hr                                    },
+    { "custom_target_heart_rate_low"  , custom_target_value_low  , read_hr                                    },
+    { "custom_target_power_high"      , custom_target_value_high , read_power                                 },
+    { "custom_target_power_low"       , custom_target_value_low  , read_power                                 },
+    { "custom_target_speed_high"      , custom_target_value_high , read_scaled<1000>                          }, // m/s
+    { "custom_target_speed_low"       , custom_target_value_low  , read_scaled<1000>                          }, // m/s
+    { "custom_target_value_high"      , custom_target_value_high , read_number<FIT_UINT32>                    },
+    { "custom_target_value_low"       , custom_target_value_low  , read_number<FIT_UINT32>                    },
+    { "duration_calories"             , duration_value           , read_number<FIT_UINT32>                    }, // kcal
+    { "duration_distance"             , duration_value           , read_scaled<100>                           }, // m
+    { "duration_hr"                   , duration_value           , read_hr                                    },
+    { "duration_power"                , duration_value           , read_power                                 },
+    { "duration_step"                 , duration_value           , read_number<FIT_UINT32>                    },
+    { "duration_time"                 , duration_value           , read_scaled<1000>                          }, // s
+    { "duration_type"                 , duration_type            , read_enum<duration_types>                  },
+    { "duration_value"                , duration_value           , read_number<FIT_UINT32>                    },
+    { "intensity"                     , intensity                , read_enum<intensities>                     },
+    { "message_index"                 , message_index            , read_range<FIT_MESSAGE_INDEX, 0, 0xFFF>    },
+    { "repeat_calories"               , target_value             , read_number<FIT_UINT32>                    }, // kcal
+    { "repeat_distance"               , target_value             , read_scaled<100>                           }, // m
+    { "repeat_hr"                     , target_value             , read_hr                                    },
+    { "repeat_power"                  , target_value             , read_power                                 },
+    { "repeat_steps"                  , target_value             , read_range<FIT_UINT32, 1, 1000>            },
+    { "repeat_time"                   , target_value             , read_scaled<1000>                          }, // s
+    { "target_hr_zone"                , target_value             , read_range<FIT_UINT32, 0, 5>               }, // 1-5, custom 0
+    { "target_power_zone"             , target_value             , read_range<FIT_UINT32, 0, 7>               }, // 1-7, custom 0
+    { "target_type"                   , target_type              , read_enum<target_types>                    },
+    { "target_value"                  , target_value             , read_number<FIT_UINT32>                    },
+    { "wkt_step_name"                 , wkt_step_name            , nullptr                                    }
+};
+} // namespace workout_step
+
+namespace {
+
+using file_creator_mesg = mesg<FIT_MESG_NUM_FILE_CREATOR, file_creator::defs>;
+using file_id_mesg = mesg<FIT_MESG_NUM_FILE_ID, file_id::defs>;
+using workout_mesg = mesg<FIT_MESG_NUM_WORKOUT, workout::defs>;
+using workout_step_mesg = mesg<FIT_MESG_NUM_WORKOUT_STEP, workout_step::defs>;
+
+//----------------------------------------------------------------------------
+// Parse FIT messages from input
+
+// Key I is known at compile time, so this is its reader and a store at
+// its field's slot
+template <const auto& Keys, size_t I, class Mesg>
+void
+read_key(reader& input, Mesg& m)
+{
+    constexpr const il_key& key = Keys[I];
+    if constexpr (key.read == nullptr) {
+        m.set(key.def, value<string_view>(input));
+    } else {
+        m.set(key.def, key.read(input));
+    }
+}
+
+template <const auto& Keys, class Mesg, size_t... I>
+void
+read_key(reader& input, Mesg& m, size_t k, index_sequence<I...>)
+{
+    static constexpr void (*readers[])(reader&, Mesg&) = {
+        read_key<Keys, I, Mesg>...
+    };
+    readers[k](input, m);
+}
+
+// Fields of a message up to its end, as its IL keys say
+template <const auto& Keys, class Mesg>
+void
+read_fields(reader& input, string_view name, Mesg& m)
+{
+    static constexpr auto n = std::size(Keys);
+    static constexpr auto fields = keywords(Keys);
+
+    for (;;) {
+        const auto k = match(input, fields);
+        if (k == n) {
+            expect(input, name);
+            return;
+        }
+        read_key<Keys>(input, m, k, make_index_sequence<n>());
+    }
+}
+
+template <>
+file_creator_mesg
+value<file_creator_mesg>(reader& input)
+{
+    file_creator_mesg ans;
+    read_fields<file_creator::keys>(input, "file_creator", ans);
+    return ans;
+}
+
+template <>
+file_id_mesg
+value<file_id_mesg>(reader& input)
+{
+    using namespace file_id;
+
+    file_id_mesg ans;
+
+    // Default values
+    ans.set(type, FIT_FILE_WORKOUT);
+    ans.set(manufacturer, FIT_MANUFACTURER_GARMIN);
+    ans.set(product, FIT_GARMIN_PRODUCT_EDGE500);
+    ans.set(serial_number, 54321);
+    ans.set(time_created,
+        fit::DateTime(static_cast<time_t>(1454942443)).GetTimeStamp());
+
+    read_fields<keys>(input, "file_id", ans);
+    return ans;
+}
+
+template <>
+workout_mesg
+value<workout_mesg>(reader& input)
+{
+    using namespace workout;
+
+    workout_mesg ans;
+
+    // Default values
+    ans.set(sport, FIT_SPORT_CYCLING);
+    ans.set(capabilities, FIT_WORKOUT_CAPABILITIES_INVALID);
+    ans.set(num_valid_steps, 1);
+
+    read_fields<keys>(input, "workout", ans);
+    return ans;
+}
+
+template <>
+workout_step_mesg
+value<workout_step_mesg>(reader& input)
+{
+    using namespace workout_step;
+
+    workout_step_mesg ans;
+
+    // Default values
+    ans.set(message_index, FIT_MESSAGE_INDEX_INVALID);
+    ans.set(duration_type, FIT_WKT_STEP_DURATION_OPEN);
+    ans.set(target_type, FIT_WKT_STEP_TARGET_OPEN);
+
+    read_fields<keys>(input, "workout_step", ans);
+    return ans;
+}
+
+//----------------------------------------------------------------------------
+// FIT encoder
+
+// Strings are null-terminated and must fit a one byte field size. Longer
+// ones are cut at the start of the UTF-8 character that doesn't fit.
+string_view
+text(const field& f)
+{
+    const auto& s = f.text;
+    if (s.size() <= 0xFE) {
+        return s;
+    }
+    size_t n = 0xFE;
+    while (n > 0 && (octet(s[n]) & 0xC0) == 0x80) {
+        --n;
+    }
+    return s.substr(0, n);
+}
+
+size_t
+size(const field& f)
+{
+    return f.type == FIT_BASE_TYPE_STRING ? text(f).size() + 1 :
+        base_size(f.type);
+}
+
+// Where a streamed FIT file goes, chunk by chunk. The header comes
+// last, once the data size is known, and belongs in front of the data.
+class sink
+{
+public:
+    virtual
+    ~sink() = default;
+
+    virtual void
+    write(string_view data) = 0;
+
+    virtual void
+    header(string_view h) = 0;
+};
+
+// Writes a whole FIT file into one contiguous buffer, or streams it to a
+// sink in chunks. Like fit::Encode, it sends every message through local
+// message type 0 and writes a new definition only when the last one
+// can't hold the message, so the output is the same byte for byte.
+class encoder
+{
+public:
+    // Chunks are about this large
+    static constexpr size_t chunk_size = 1 << 16;
+
+    // Bumped whenever the same IL would convert differently
+    static constexpr unsigned format = 2;
+
+    // What the FIT file for il is cached under: the IL, with whitespace
+    // around text lines ignored as the parser does, the format and the
+    // FIT profile the tables come from
+    static string
+    cache_key(string_view il)
+    {
+        thread_local string norm;
+        norm = S("il2fit-cache-" << format << '-' << FIT_PROFILE_VERSION
+                 << '\n');
+        reader input(il);
+        if (input.binary) {
+            norm += il;
+        } else {
+            while (const auto lopt = line(input)) {
+                norm += trim(lopt.value());
+                norm += '\n';
+            }
+        }
+        return fit_cache::key(norm);
+    }
+
+    void
+    open(sink* out = nullptr)
+    {
+        buffer_.clear();
+        if (!out) {
+            buffer_.append(FIT_FILE_HDR_SIZE, '\0');
+        }
+        sink_ = out;
+        crc_ = 0;
+        size_ = 0;
+        def_.num = FIT_MESG_NUM_INVALID;
+        def_.count = 0;
+    }
+
+    template <FIT_UINT16 Num, const auto& Defs>
+    void
+    write(const mesg<Num, Defs>& m)
+    {
+        if (!supports(m)) {
+            define(m);
+        }
+
+        put(0);                 // Data record, local message 0
+
+        for (size_t i = 0; i < def_.count; ++i) {
+            const auto& d = def_.fields[i];
+            size_t n = 0;
+            if (const auto f = m.get(d.slot)) {
+                n = put(*f);
+            }
+            // Pad with the invalid value of the type
+            const auto invalid = base_invalid(d.type);
+            const auto k = base_size(d.type);
+            for (; n < d.size; ++n) {
+                put(invalid >> (8 * (n % k)));
+            }
+        }
+
+        if (sink_ && buffer_.size() >= chunk_size) {
+            flush();
+        }
+    }
+
+    // Patch the header and append the CRC. Streamed files are finished
+    // in the sink, and nothing is returned for them.
+    string_view
+    close()
+    {
+        if (sink_) {
+            flush();
+            char h[FIT_FILE_HDR_SIZE];
+            header(h, size_);
+            // The file CRC covers the header, which was never streamed
+            char crc[2];
+            le(crc, crc16_combine(crc16(0, string_view(h, sizeof(h))),
+                                  crc_, size_), 2);
+            sink_->write(string_view(crc, 2));
+            sink_->header(string_view(h, sizeof(h)));
+            sink_ = nullptr;
+            return {};
+        }
+
+        header(&buffer_[0], buffer_.size() - FIT_FILE_HDR_SIZE);
+
+        char crc[2];
+        le(crc, crc16(0, buffer_), 2);
+        buffer_.append(crc, 2);
+
+        return buffer_;
+    }
+
+    string_view
+    data() const
+    {
+        return buffer_;
+    }
+
+    // Hand over the closed file, leaving the encoder without a buffer
+    string
+    release()
+    {
+        return std::move(buffer_);
+    }
+
+private:
+    static constexpr size_t max_fields = 16;
+
+    // Fields in the order they're written, and the sizes of the
+    // message's fields by slot, 0 for those left out
+    struct definition
+    {
+        FIT_UINT16 num;
+        size_t count;
+        struct {
+            FIT_UINT8 num;
+            FIT_UINT8 size;
+            FIT_UINT8 type;
+            FIT_UINT8 slot;
+        } fields[max_fields];
+        FIT_UINT8 sizes[max_fields];
+    };
+
+    static void
+    le(char* p, FIT_UINT32 v, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            p[i] = static_cast<char>(v >> (8 * i));
+        }
+    }
+
+    static void
+    header(char* h, size_t size)
+    {
+        if (size > 0xFFFFFFFF) {
+            error("FIT file too large");
+        }
+        h[0] = FIT_FILE_HDR_SIZE;
+        h[1] = FIT_PROTOCOL_VERSION_10;
+        le(h + 2, FIT_PROFILE_VERSION, 2);
+        le(h + 4, size, 4);
+        memcpy(h + 8, ".FIT", 4);
+        le(h + 12, crc16(0, string_view(h, 12)), 2);
+    }
+
+    // Hand the buffer to the sink, keeping count of what went there
+    void
+    flush()
+    {
+        crc_ = crc16(crc_, buffer_);
+        size_ += buffer_.size();
+        sink_->write(buffer_);
+        buffer_.clear();
+    }
+
+    void
+    put(FIT_UINT32 byte)
+    {
+        buffer_.push_back(static_cast<char>(byte));
+    }
+
+    size_t
+    put(const field& f)
+    {
+        if (f.type == FIT_BASE_TYPE_STRING) {
+            buffer_.append(text(f));
+            put(0);
+        } else {
+            char bytes[4];
+            le(bytes, f.number, base_size(f.type));
+            buffer_.append(bytes, base_size(f.type));
+        }
+        return size(f);
+    }
+
+    // Same message number means the same slots
+    template <class Mesg>
+    bool
+    supports(const Mesg& m) const
+    {
+        if (def_.num != m.num) {
+            return false;
+        }
+        for (const auto& f : m) {
+            if (size(f) > def_.sizes[f.slot]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <class Mesg>
+    void
+    define(const Mesg& m)
+    {
+        static_assert(Mesg::size <= max_fields);
+
+        def_.num = m.num;
+        def_.count = 0;
+        std::fill(def_.sizes, def_.sizes + max_fields, 0);
+
+        put(FIT_HDR_TYPE_DEF_BIT); // Definition record, local message 0
+        put(0);                 // Reserved
+        put(0);                 // Little endian
+        put(m.num & 0xFF);
+        put(m.num >> 8);
+        put(m.end() - m.begin());
+
+        for (const auto& f : m) {
+            const auto n = static_cast<FIT_UINT8>(size(f));
+            def_.fields[def_.count++] = { f.num, n, f.type, f.slot };
+            def_.sizes[f.slot] = n;
+            put(f.num);
+            put(size(f));
+            put(f.type);
+        }
+    }
+
+    string buffer_;
+    sink* sink_ = nullptr;
+    FIT_UINT16 crc_ = 0;        // Of the data streamed so far
+    size_t size_ = 0;
+    definition def_ = {};
+};
+
+// Streams FIT to an ostream. Seekable streams get the file as it is,
+// with the header written over a placeholder at the end. The data for
+// others, such as pipes, is spooled to a temporary file and copied out
+// after the header, so they get the same plain FIT file.
+class ostream_sink : public sink
+{
+public:
+    explicit
+    ostream_sink(ostream& out) :
+        out_(out),
+        start_(out.tellp())
+    {
+        if (seekable()) {
+            const char placeholder[FIT_FILE_HDR_SIZE] = {};
+            put(string_view(placeholder, sizeof(placeholder)));
+        } else if (!(spool_ = tmpfile())) {
+            error("Can't create a temporary file");
+        }
+    }
+
+    ostream_sink(const ostream_sink&) = delete;
+    ostream_sink& operator=(const ostream_sink&) = delete;
+
+    ~ostream_sink() override
+    {
+        if (spool_) {
+            fclose(spool_);
+        }
+    }
+
+    bool
+    seekable() const
+    {
+        return start_ != ostream::pos_type(-1);
+    }
+
+    void
+    write(string_view data) override
+    {
+        if (!spool_) {
+            put(data);
+        } else if (fwrite(data.data(), 1, data.size(), spool_) !=
+                   data.size()) {
+            error("Can't write a temporary file");
+        }
+    }
+
+    void
+    header(string_view h) override
+    {
+        if (!spool_) {
+            const auto end = out_.tellp();
+            out_.seekp(start_);
+            if (!out_.write(h.data(), h.size())) {
+                error("Can't write output");
+            }
+            out_.seekp(end);
+        } else {
+            put(h);
+            rewind(spool_);
+            char buf[encoder::chunk_size];
+            while (const auto n = fread(buf, 1, sizeof(buf), spool_)) {
+                put(string_view(buf, n));
+            }
+            if (ferror(spool_)) {
+                error("Can't read a temporary file");
+            }
+        }
+        if (!out_.flush()) {
+            error("Can't write output");
+        }
+    }
+
+    // Bytes of FIT written
+    size_t
+    written() const
+    {
+        return written_;
+    }
+
+private:
+    void
+    put(string_view data)
+    {
+        if (!out_.write(data.data(), data.size())) {
+            error("Can't write output");
+        }
+        written_ += data.size();
+    }
+
+    ostream& out_;
+    const ostream::pos_type start_;
+    FILE* spool_ = nullptr;
+    size_t written_ = 0;
+};
+
+// Messages, numbered as in binary IL
+constexpr auto message_names = keywords({
+        "file_creator",
+        "file_id",
+        "workout",
+        "workout_step"
+    });
+
+// Rethrow exn with where the input is: the line, or the byte offset in
+// binary IL, and the message block
+[[noreturn]]
+void
+located(const reader& input, const exception& exn)
+{
+    const auto block = input.block == 0 ? string() :
+        input.mesg ?
+        S(", in block " << input.block << " ("
+          << *message_names.name(input.mesg.value()) << ")") :
+        S(", in block " << input.block);
+    if (input.binary) {
+        error(S(exn.what() << " at byte " << input.pos << block));
+    }
+    error(S(exn.what() << " at line " << input.line << block));
+}
+
+// Start the next message, none at the end of the document
+optional<size_t>
+message(reader& input)
+{
+    static constexpr auto commands = keywords({
+            "begin",
+            "EOF"
+        });
 
     try {
-        il2fit(cin, output);
-    } catch (const exception& exn) {
-        cerr << exn.what() << endl;
-        return 1;
+        if (input.binary) {
+            const auto& b = input.buffer;
+            if (input.pos == b.size() || b[input.pos] == binary_magic[0]) {
+                return none;
+            }
+            ++input.block;
+            input.mesg = none;  // Until it's known to be one
+            const auto m = record(input).first;
+            if (!message_names.name(m)) {
+                error(S("Bad message " << m));
+            }
+            input.mesg = m;
+            return input.mesg;
+        }
+
+        const auto lopt = line(input);
+        if (!lopt || match(lopt.value(), commands) == commands["EOF"]) {
+            return none;
+        }
+        ++input.block;
+        input.mesg = none;
+        input.mesg = match(input, message_names);
+        return input.mesg;
+    } catch (const runtime_error& exn) {
+        located(input, exn);
+    }
+}
+
+// value() of a message, with the location in errors
+template <class Mesg>
+Mesg
+read_message(reader& input)
+{
+    try {
+        return value<Mesg>(input);
+    } catch (const runtime_error& exn) {
+        located(input, exn);
     }
+}
 
-    cout << output.str();
+//----------------------------------------------------------------------------
+// Timings and counters for --stats
 
-    return 0;
+using stats_clock = chrono::steady_clock;
+
+double
+seconds(stats_clock::duration d)
+{
+    return chrono::duration<double>(d).count();
 }
 
-#else  // _WITH_TESTS
+// What converting one document took. Tokenizing happens as messages are
+// parsed, so it's in the parse times.
+struct doc_stats
+{
+    static constexpr size_t kinds = 4; // Messages, in il2fit()'s order
 
-#define CATCH_CONFIG_MAIN
-#include <catch.hpp>
+    double read = 0;            // Seconds
+    double parse[kinds] = {};
+    double write = 0;
+    double close = 0;
+    double output = 0;
+    size_t messages[kinds] = {};
+    size_t tokens = 0;
+    size_t bytes_in = 0;
+    size_t bytes_out = 0;
+    bool cached = false;
+    bool failed = false;
+};
+
+template <class Mesg>
+void
+convert_message(reader& input, encoder& encode, doc_stats* stats,
+                size_t kind)
+{
+    if (!stats) {
+        encode.write(read_message<Mesg>(input));
+        return;
+    }
+    const auto t0 = stats_clock::now();
+    const auto mesg = read_message<Mesg>(input);
+    const auto t1 = stats_clock::now();
+    encode.write(mesg);
+    stats->parse[kind] += seconds(t1 - t0);
+    stats->write += seconds(stats_clock::now() - t1);
+    ++stats->messages[kind];
+}
+
+// Messages up to the end of the document, counted in count as they're
+// encoded
+void
+convert_messages(reader& input, encoder& encode, doc_stats* stats,
+                 size_t& count)
+{
+    static constexpr auto& messages = message_names;
+    static_assert(messages["workout_step"] + 1 == doc_stats::kinds);
+
+    while (const auto mopt = message(input)) {
+        switch (mopt.value()) {
+        case messages["file_creator"]:
+            convert_message<file_creator_mesg>(input, encode, stats,
+                                               mopt.value());
+            break;
+        case messages["file_id"]:
+            convert_message<file_id_mesg>(input, encode, stats, mopt.value());
+            break;
+        case messages["workout"]:
+            convert_message<workout_mesg>(input, encode, stats, mopt.value());
+            break;
+        case messages["workout_step"]:
+            convert_message<workout_step_mesg>(input, encode, stats,
+                                               mopt.value());
+            break;
+        }
+        ++count;
+    }
+}
+
+void
+il2fit(reader& input, encoder& encode, sink* out = nullptr,
+       doc_stats* stats = nullptr)
+{
+    encode.open(out);
+
+    size_t count = 0;
+    convert_messages(input, encode, stats, count);
+    if (count == 0) {
+        error("No messages in the FIT file");
+    }
+
+    const auto t0 = stats ? stats_clock::now() : stats_clock::time_point();
+    encode.close();
+    if (stats) {
+        stats->close += seconds(stats_clock::now() - t0);
+        stats->tokens += input.tokens;
+        stats->bytes_in += input.buffer.size();
+    }
+}
 
 //----------------------------------------------------------------------------
-// Cases for trim()
+// Check IL without encoding
 
-TEST_CASE("Trim empty string", "[trim]")
+// What converting doesn't check across messages: that the workout has
+// as many steps as it declares, and that repeat steps only repeat the
+// steps before them
+class il_checker
 {
-    CHECK(trim("") == "");
+public:
+    // input where the workout began
+    void
+    workout(const workout_mesg& m, const reader& input)
+    {
+        valid_steps_ = m.get(workout::num_valid_steps.slot)->number;
+        workout_ = input;
+    }
+
+    void
+    step(const workout_step_mesg& m, const reader& input)
+    {
+        using namespace workout_step;
+        if (repeat_duration(m.get(duration_type.slot)->number)) {
+            const auto from = m.get(duration_value.slot);
+            if (!from) {
+                located(input, runtime_error("Repeat without duration_step"));
+            }
+            if (from->number >= seen_.size() || !seen_[from->number]) {
+                located(input, runtime_error(
+                            S("Repeat from step " << from->number
+                              << ", not an earlier one")));
+            }
+        }
+        const auto index = m.get(message_index.slot)->number;
+        if (index < seen_.size()) {
+            seen_[index] = true;
+        }
+        ++count_;
+    }
+
+    void
+    finish() const
+    {
+        if (workout_ && valid_steps_ != count_) {
+            located(workout_.value(), runtime_error(
+                        S("Workout has " << count_ << " steps, "
+                          << valid_steps_ << " declared")));
+        }
+    }
+
+private:
+    bitset<0x1000> seen_;       // Message indices of the steps so far
+    size_t count_ = 0;
+    FIT_UINT32 valid_steps_ = 0;
+    optional<reader> workout_;  // Where it was read
+};
+
+// Parse a document as il2fit() does, and check it as il_checker does,
+// without encoding it. Stops after its EOF line, or at the next binary
+// magic, and returns the number of messages.
+size_t
+check_document(reader& input)
+{
+    static constexpr auto& messages = message_names;
+
+    il_checker checker;
+    size_t count = 0;
+
+    while (const auto mopt = message(input)) {
+        switch (mopt.value()) {
+        case messages["file_creator"]:
+            read_message<file_creator_mesg>(input);
+            break;
+        case messages["file_id"]:
+            read_message<file_id_mesg>(input);
+            break;
+        case messages["workout"]: {
+            const auto at = input;  // Its begin line, for the step count
+            checker.workout(read_message<workout_mesg>(input), at);
+            break;
+        }
+        case messages["workout_step"]:
+            checker.step(read_message<workout_step_mesg>(input), input);
+            break;
+        }
+        ++count;
+    }
+
+    if (count > 0) {
+        checker.finish();
+    }
+    return count;
 }
 
-TEST_CASE("Trim string, empty ans", "[trim]")
+//----------------------------------------------------------------------------
+// Split input into IL documents separated by EOF lines, or binary IL
+// documents each starting with its magic
+
+optional<string_view>
+binary_document(reader& input)
 {
-    CHECK(trim(" \t\t ") == "");
+    const auto& b = input.buffer;
+    if (input.pos >= b.size()) {
+        return none;
+    }
+
+    const auto begin = input.pos - binary_magic.size();
+    while (input.pos < b.size() && b[input.pos] != binary_magic[0]) {
+        record(input);
+        input.pos = input.end;
+        input.end = b.size();
+    }
+    const auto ans = b.substr(begin, input.pos - begin);
+
+    if (input.pos < b.size()) {
+        if (b.substr(input.pos, binary_magic.size()) != binary_magic) {
+            error("Bad binary IL");
+        }
+        input.pos += binary_magic.size();
+    }
+    return some(ans);
 }
 
-TEST_CASE("Trim string left", "[trim]")
+optional<string_view>
+document(reader& input)
 {
-    CHECK(trim(" \tabc") == "abc");
+    if (input.binary) {
+        return binary_document(input);
+    }
+
+    const auto begin = input.pos;
+    auto end = begin;
+    bool blank = true;
+
+    while (const auto lopt = line(input)) {
+        const auto token = trim(lopt.value());
+        if (token == "EOF") {
+            return some(input.buffer.substr(begin, end - begin));
+        }
+        blank = blank && token.empty();
+        end = min(input.pos, input.buffer.size());
+    }
+
+    if (blank) {
+        return none;
+    }
+    return some(input.buffer.substr(begin, end - begin));
 }
 
-TEST_CASE("Trim string right", "[trim]")
+// Whether the document that starts at input is only blank lines, and
+// whether another one follows it. Only for errors, it reads it again.
+pair<bool, bool>
+blank_and_followed(reader input)
 {
-    CHECK(trim("abc\t ") == "abc");
+    try {
+        const auto doc = document(input);
+        return make_pair(!doc, doc && document(input));
+    } catch (const runtime_error&) {
+        return make_pair(false, false);
+    }
+}
+
+// Every document of the input, as il2fit --chain would convert them, in
+// one pass. Lines and bytes in errors count from the start of the input.
+void
+check(reader& input)
+{
+    const auto& b = input.buffer;
+    for (size_t n = 0;; ++n) {
+        const auto start = input;
+        input.block = 0;
+        try {
+            if (check_document(input) == 0) {
+                error("No messages in the FIT file");
+            }
+        } catch (const runtime_error& exn) {
+            const auto [blank, followed] = blank_and_followed(start);
+            if (blank) {
+                // Blank lines after the last EOF line end the input
+                if (n > 0) {
+                    return;
+                }
+                error("No messages in the FIT file");
+            }
+            if (n == 0 && !followed) {
+                throw;
+            }
+            error(S("Document " << n << ": " << exn.what()));
+        }
+
+        if (input.pos >= b.size()) {
+            return;
+        }
+        if (input.binary) {
+            if (b.substr(input.pos, binary_magic.size()) != binary_magic) {
+                error("Bad binary IL");
+            }
+            input.pos += binary_magic.size();
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Work-stealing thread pool
+
+class work_queue
+{
+public:
+    void
+    push(size_t i)
+    {
+        lock_guard<mutex> lock(m_);
+        q_.push_back(i);
+    }
+
+    // Owner takes the lowest index left
+    bool
+    pop(size_t& i)
+    {
+        lock_guard<mutex> lock(m_);
+        if (q_.empty()) {
+            return false;
+        }
+        i = q_.front();
+        q_.pop_front();
+        return true;
+    }
+
+    // Thieves take the highest one
+    bool
+    steal(size_t& i)
+    {
+        lock_guard<mutex> lock(m_);
+        if (q_.empty()) {
+            return false;
+        }
+        i = q_.back();
+        q_.pop_back();
+        return true;
+    }
+
+private:
+    mutex m_;
+    deque<size_t> q_;
+};
+
+// Run run(0) ... run(n - 1) on up to jobs threads, and commit(i) on the
+// calling thread in index order, as soon as run(i) is done. Neither
+// function may throw.
+void
+parallel(size_t jobs, size_t n,
+         const function<void(size_t)>& run,
+         const function<void(size_t)>& commit)
+{
+    jobs = min(jobs, n);
+
+    if (jobs <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            run(i);
+            commit(i);
+        }
+        return;
+    }
+
+    vector<work_queue> queues(jobs);
+    for (size_t i = 0; i < n; ++i) {
+        queues[i % jobs].push(i);
+    }
+
+    mutex m;
+    condition_variable cv;
+    vector<bool> done(n, false);
+
+    const auto work = [&](size_t self) {
+        for (size_t i;;) {
+            bool found = queues[self].pop(i);
+            for (size_t k = 1; !found && k < jobs; ++k) {
+                found = queues[(self + k) % jobs].steal(i);
+            }
+            if (!found) {
+                break;
+            }
+            run(i);
+            {
+                lock_guard<mutex> lock(m);
+                done[i] = true;
+            }
+            cv.notify_one();
+        }
+    };
+
+    vector<thread> threads;
+    for (size_t self = 0; self < jobs; ++self) {
+        threads.emplace_back(work, self);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&] { return done[i]; });
+        }
+        commit(i);
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+//----------------------------------------------------------------------------
+// Parse large documents in parallel
+
+using any_mesg = variant<file_creator_mesg, file_id_mesg, workout_mesg,
+                         workout_step_mesg>;
+
+// Offsets of chunks of about size bytes, each starting with a message.
+// Text is cut at the next "begin" line, which may turn out to be a
+// value instead, parse_chunk() finds out. Binary records are walked.
+vector<size_t>
+chunk_starts(const reader& input, size_t size)
+{
+    const auto& b = input.buffer;
+    vector<size_t> ans = { input.pos };
+
+    if (input.binary) {
+        for (auto pos = input.pos;
+             pos + 3 <= b.size() && b[pos] != binary_magic[0];
+             pos += 3 + (octet(b[pos + 1]) | octet(b[pos + 2]) << 8)) {
+            if (pos - ans.back() >= size) {
+                ans.push_back(pos);
+            }
+        }
+        return ans;
+    }
+
+    for (auto pos = input.pos + size; pos < b.size(); ) {
+        const auto at = b.find("\nbegin\n", pos - 1);
+        if (at == string_view::npos) {
+            break;
+        }
+        ans.push_back(at + 1);
+        pos = at + 1 + size;
+    }
+    return ans;
+}
+
+struct chunk
+{
+    vector<any_mesg> messages;
+    size_t lines = 0;
+    bool parsed = false;        // All of it, see parse_chunk()
+};
+
+// Messages of a chunk, as il2fit() reads them. It's parsed only if they
+// take all of it, not if it was cut at a value or the document ends in
+// it.
+void
+parse_chunk(string_view data, bool binary, chunk& ans, doc_stats* stats)
+{
+    static constexpr auto& names = message_names;
+
+    auto& messages = ans.messages;
+    reader input(data, binary);
+    while (input.pos < data.size()) {
+        const auto mopt = message(input);
+        if (!mopt) {
+            return;
+        }
+        const auto t0 = stats ? stats_clock::now() : stats_clock::time_point();
+        switch (mopt.value()) {
+        case names["file_creator"]:
+            messages.push_back(value<file_creator_mesg>(input));
+            break;
+        case names["file_id"]:
+            messages.push_back(value<file_id_mesg>(input));
+            break;
+        case names["workout"]:
+            messages.push_back(value<workout_mesg>(input));
+            break;
+        case names["workout_step"]:
+            messages.push_back(value<workout_step_mesg>(input));
+            break;
+        }
+        if (stats) {
+            stats->parse[mopt.value()] += seconds(stats_clock::now() - t0);
+            ++stats->messages[mopt.value()];
+        }
+    }
+    if (stats) {
+        stats->tokens += input.tokens;
+    }
+    ans.lines = input.line;
+    ans.parsed = true;
+}
+
+// il2fit() for documents of several chunks, parsed on up to jobs threads
+// and encoded in order. From the first chunk that fails on, the document
+// is read as il2fit() does, so that it fails where and as il2fit() would.
+void
+il2fit_parallel(reader& input, encoder& encode, size_t jobs,
+                doc_stats* stats = nullptr, size_t chunk_size = 1 << 16)
+{
+    if (jobs <= 1 || input.buffer.size() - input.pos < 2 * chunk_size) {
+        il2fit(input, encode, nullptr, stats);
+        return;
+    }
+
+    const auto& b = input.buffer;
+    const auto starts = chunk_starts(input, chunk_size);
+    const auto n = starts.size();
+    vector<chunk> chunks(n);
+    vector<doc_stats> chunk_stats(stats ? n : 0);
+    atomic<size_t> first_failed(n);
+    size_t resume = n;
+    size_t count = 0;
+    size_t lines = 0;
+
+    encode.open();
+    parallel(jobs, n,
+             [&](size_t i) {
+                 if (i > first_failed) {
+                     return;
+                 }
+                 const auto end = i + 1 < n ? starts[i + 1] : b.size();
+                 try {
+                     parse_chunk(b.substr(starts[i], end - starts[i]),
+                                 input.binary, chunks[i],
+                                 stats ? &chunk_stats[i] : nullptr);
+                 } catch (const exception&) {
+                 }
+                 const auto parsed = chunks[i].parsed;
+                 for (auto f = first_failed.load(); !parsed && i < f; ) {
+                     first_failed.compare_exchange_weak(f, i);
+                 }
+             },
+             [&](size_t i) {
+                 auto& c = chunks[i];
+                 if (resume < n || !c.parsed) {
+                     resume = min(resume, i);
+                     c = chunk();
+                     return;
+                 }
+                 const auto t0 = stats_clock::now();
+                 for (const auto& m : c.messages) {
+                     visit([&](const auto& m) { encode.write(m); }, m);
+                 }
+                 count += c.messages.size();
+                 lines += c.lines;
+                 c = chunk();
+                 if (stats) {
+                     const auto& cs = chunk_stats[i];
+                     for (size_t k = 0; k < doc_stats::kinds; ++k) {
+                         stats->parse[k] += cs.parse[k];
+                         stats->messages[k] += cs.messages[k];
+                     }
+                     stats->tokens += cs.tokens;
+                     stats->write += seconds(stats_clock::now() - t0);
+                 }
+             });
+
+    if (resume < n) {
+        // Where the chunks before it left off
+        input.pos = starts[resume];
+        input.end = b.size();
+        input.line = lines;
+        input.block = count;
+        convert_messages(input, encode, stats, count);
+    }
+    if (count == 0) {
+        error("No messages in the FIT file");
+    }
+
+    const auto t0 = stats ? stats_clock::now() : stats_clock::time_point();
+    encode.close();
+    if (stats) {
+        stats->close += seconds(stats_clock::now() - t0);
+        stats->tokens += input.tokens;
+        stats->bytes_in += b.size();
+    }
+}
+
+} // namespace
+
+//----------------------------------------------------------------------------
+// Library API
+
+struct wrked::converter::state
+{
+    encoder encode;
+};
+
+wrked::converter::converter() :
+    state_(new state)
+{
+}
+
+wrked::converter::~converter() = default;
+
+string_view
+wrked::converter::convert(string_view il)
+{
+    reader input(il);
+    il2fit(input, state_->encode);
+    return state_->encode.data();
+}
+
+string
+wrked::convert(string_view il)
+{
+    return string(converter().convert(il));
+}
+
+void
+wrked::check(string_view il)
+{
+    reader input(il);
+    ::check(input);
+}
+
+void
+wrked::verify(string_view fit)
+{
+    ::verify(fit);
+}
+
+string
+wrked::decode(string_view fit)
+{
+    string ans;
+    fit2il(fit, ans);
+    return ans;
+}
+
+vector<wrked::result>
+wrked::convert_batch(string_view il, size_t jobs)
+{
+    vector<string_view> docs;
+    reader input(il);
+    while (const auto doc = document(input)) {
+        docs.push_back(doc.value());
+    }
+
+    // Threads left over parse large documents
+    const auto inner = max<size_t>(1, jobs / max<size_t>(1, docs.size()));
+    vector<result> ans(docs.size());
+    parallel(jobs, docs.size(),
+             [&](size_t i) {
+                 // The result owns the buffer, so keeping an encoder per
+                 // thread would only pin the largest one after the batch
+                 try {
+                     encoder encode;
+                     reader input(docs[i]);
+                     il2fit_parallel(input, encode, inner);
+                     ans[i].fit = encode.release();
+                 } catch (const exception& exn) {
+                     ans[i].error = exn.what();
+                 }
+             },
+             [](size_t) {});
+
+    return ans;
+}
+
+//----------------------------------------------------------------------------
+// Main
+
+#if !defined(_WITH_TESTS) && !defined(_WITH_BENCHMARKS) && \
+    !defined(_AS_LIBRARY)
+
+// Threads for --jobs N: one per CPU for 0, and no more than 4 per CPU,
+// so that a typo or a negative number can't start thousands of them
+optional<size_t>
+parse_jobs(const string& arg)
+{
+    const size_t cpus = max(1u, thread::hardware_concurrency());
+    istringstream iss(arg);
+    size_t n;
+    if (arg.empty() || !isdigit(octet(arg[0])) || !(iss >> n) ||
+        !iss.eof()) {
+        return none;
+    }
+    return some(n == 0 ? cpus : min(n, 4 * cpus));
+}
+
+namespace {
+
+void
+usage()
+{
+    cerr << "Usage: il2fit [-o FILE | --batch PREFIX | --list FILE] [--jobs N]" << endl
+         << "              [--cache DIR [--cache-size N]] [--stats] [INPUT]" << endl
+         << "       il2fit --chain [-o FILE] [--jobs N] [--cache DIR] [--stats] [INPUT]" << endl
+         << "       il2fit --stream [-o FILE] [--stats] [INPUT]" << endl
+         << "       il2fit --check [--jobs N] [INPUT...]" << endl
+         << "       il2fit --verify [--jobs N] [FIT...]" << endl
+         << "       il2fit --decode [-o DIR] [--jobs N] [FIT | DIR...]" << endl
+         << "       il2fit --serve SOCKET [--jobs N] [--cache DIR [--cache-size N]]" << endl
+         << endl
+         << "Without options, convert one IL document from INPUT (default stdin)" << endl
+         << "to FIT on stdout. Regular files are mapped rather than read." << endl
+         << "Text and binary IL (wrk2il -mode bin) are both accepted." << endl
+         << endl
+         << "  -o, --output FILE" << endl
+         << "                  Write FIT to FILE instead of stdout" << endl
+         << "  --batch PREFIX  Read IL documents separated by EOF lines from INPUT," << endl
+         << "                  write each one to PREFIX<N>.fit, N counting from 0" << endl
+         << "  --list FILE     Read input and output paths from FILE (\"-\" for" << endl
+         << "                  stdin), one path per line, and convert each input" << endl
+         << "  --jobs N        Convert up to N documents in parallel, or parse a" << endl
+         << "                  large document on N threads, 0 for one per CPU" << endl
+         << "                  (default 1, at most 4 per CPU)" << endl
+         << "  --chain         Convert IL documents separated by EOF lines from INPUT" << endl
+         << "                  into one chained FIT file, in order. Nothing more" << endl
+         << "                  is written after a document fails" << endl
+         << "  --stream        Write FIT as it's encoded, without holding it in" << endl
+         << "                  memory. If the output can't seek back to fill in" << endl
+         << "                  the header, the FIT data waits in a temporary file." << endl
+         << "                  Memory stays constant only for INPUT files and" << endl
+         << "                  stdin redirected from one; piped IL is read whole" << endl
+         << "  --check         Parse every IL document (default stdin) as when" << endl
+         << "                  converting, without converting them, and check that" << endl
+         << "                  each workout has num_valid_steps steps and that" << endl
+         << "                  repeat steps repeat earlier ones" << endl
+         << "  --verify        Check the structure and CRCs of FIT files (default" << endl
+         << "                  stdin), chained ones too, and that workout steps" << endl
+         << "                  are numbered in order and repeat earlier steps" << endl
+         << "  --decode        Convert FIT files back to IL, for the messages and" << endl
+         << "                  fields il2fit writes. Directories are searched for" << endl
+         << "                  .fit files. IL goes to stdout, documents separated" << endl
+         << "                  by EOF lines, or with -o to DIR, one .il file for" << endl
+         << "                  each FIT file at the same relative path. Enum" << endl
+         << "                  values without an IL name fail the file" << endl
+         << "  --cache DIR     Keep FIT files in DIR by the hash of their IL, and" << endl
+         << "                  reuse them for the same IL instead of converting" << endl
+         << "  --cache-size N  Remove least recently used files from the cache" << endl
+         << "                  once it's larger than N MiB (default 256)" << endl
+         << "  --serve SOCKET  Stay resident and convert IL sent to the Unix socket" << endl
+         << "                  SOCKET, until SIGINT or SIGTERM. A client writes an" << endl
+         << "                  IL document and shuts down writing, then reads a 0" << endl
+         << "                  byte and FIT, or a 1 byte and the error message" << endl
+         << "  --stats         When converting, print timings of each phase and" << endl
+         << "                  counters as JSON to stderr, with percentiles over" << endl
+         << "                  documents. Also on if IL2FIT_STATS is set and not 0" << endl;
+}
+
+struct job
+{
+    string name;                // For error reports
+    string path;                // IL file, or empty to convert il
+    string_view il;             // IL document
+    string output;              // FIT file
+};
+
+void
+read_batch(reader& input, const string& prefix, vector<job>& jobs)
+{
+    for (size_t n = 0; const auto doc = document(input); ++n) {
+        jobs.push_back({ S("Document " << n), "", doc.value(),
+                    S(prefix << n << ".fit") });
+    }
+}
+
+void
+read_list(istream& paths, vector<job>& jobs)
+{
+    while (const auto iopt = line(paths)) {
+        const string in(trim(iopt.value()));
+        if (in.empty()) {
+            continue;
+        }
+        const auto out = value<string>(paths);
+        jobs.push_back({ in, in, "", out });
+    }
+}
+
+// FIT file for the IL document, from the cache if there's one and it
+// has it, or encoded and added to it, parsed on up to jobs threads if
+// it's large. The result is in either encode or hit, valid until they
+// change.
+string_view
+il2fit(string_view il, encoder& encode, fit_cache* cache, string& hit,
+       doc_stats* stats = nullptr, size_t jobs = 1)
+{
+    string key;
+    if (cache) {
+        key = encoder::cache_key(il);
+        if (cache->get(key, hit)) {
+            if (stats) {
+                stats->cached = true;
+                stats->bytes_in += il.size();
+                stats->bytes_out += hit.size();
+            }
+            return hit;
+        }
+    }
+
+    reader input(il);
+    il2fit_parallel(input, encode, jobs, stats);
+    if (cache) {
+        cache->put(key, encode.data());
+    }
+    if (stats) {
+        stats->bytes_out += encode.data().size();
+    }
+    return encode.data();
+}
+
+void
+il2fit(string_view il, const string& path, fit_cache* cache,
+       doc_stats* stats = nullptr, size_t jobs = 1)
+{
+    // Parsing doesn't allocate, and these keep their buffers from one
+    // document to the next on the same thread
+    thread_local encoder encode;
+    thread_local string hit;
+    const auto data = il2fit(il, encode, cache, hit, stats, jobs);
+    const auto t0 = stats_clock::now();
+    ofstream output(path, ios::out | ios::binary | ios::trunc);
+    output.write(data.data(), data.size());
+    output.close();
+    if (!output) {
+        remove(path.c_str());
+        error("Can't write \"" + path + "\"");
+    }
+    if (stats) {
+        stats->output += seconds(stats_clock::now() - t0);
+    }
+}
+
+void
+convert(const job& j, fit_cache* cache, doc_stats* stats)
+{
+    if (j.path.empty()) {
+        il2fit(j.il, j.output, cache, stats);
+    } else {
+        const auto t0 = stats_clock::now();
+        const il_file file(j.path);
+        if (stats) {
+            stats->read += seconds(stats_clock::now() - t0);
+        }
+        il2fit(file.data(), j.output, cache, stats);
+    }
+}
+
+// With stats, they get one entry for each job
+size_t
+convert(const vector<job>& jobs, size_t threads, fit_cache* cache,
+        vector<doc_stats>* stats = nullptr)
+{
+    vector<string> errors(jobs.size());
+    size_t failed = 0;
+    if (stats) {
+        stats->assign(jobs.size(), doc_stats());
+    }
+
+    parallel(threads, jobs.size(),
+             [&](size_t i) {
+                 try {
+                     convert(jobs[i], cache, stats ? &(*stats)[i] : nullptr);
+                 } catch (const exception& exn) {
+                     errors[i] = exn.what();
+                 }
+             },
+             [&](size_t i) {
+                 if (!errors[i].empty()) {
+                     cerr << jobs[i].name << ": " << errors[i] << endl;
+                     ++failed;
+                     if (stats) {
+                         (*stats)[i].failed = true;
+                     }
+                 }
+             });
+
+    return failed;
+}
+
+void
+il2fit_stdout(string_view il, fit_cache* cache, doc_stats* stats,
+              size_t jobs)
+{
+    encoder encode;
+    string hit;
+    const auto data = il2fit(il, encode, cache, hit, stats, jobs);
+    const auto t0 = stats_clock::now();
+    if (!cout.write(data.data(), data.size()).flush()) {
+        error("Can't write output");
+    }
+    if (stats) {
+        stats->output += seconds(stats_clock::now() - t0);
+    }
+}
+
+// Every document of the input as one chained FIT file, to path or
+// stdout. Documents are converted in parallel and written in order, and
+// nothing is written after the first failure. Returns how many failed.
+size_t
+chain(reader& input, const string& path, size_t threads, fit_cache* cache,
+      vector<doc_stats>* stats = nullptr)
+{
+    vector<string_view> docs;
+    while (const auto doc = document(input)) {
+        docs.push_back(doc.value());
+    }
+    if (docs.empty()) {
+        error("No documents in the input");
+    }
+
+    ofstream file;
+    if (!path.empty()) {
+        file.open(path, ios::out | ios::binary | ios::trunc);
+        if (!file) {
+            error("Can't write \"" + path + "\"");
+        }
+    }
+    ostream& output = path.empty() ? cout : file;
+
+    vector<string> fits(docs.size());
+    vector<string> errors(docs.size());
+    size_t failed = 0;
+    if (stats) {
+        stats->assign(docs.size(), doc_stats());
+    }
+    const auto inner = max<size_t>(1, threads / docs.size());
+
+    parallel(threads, docs.size(),
+             [&](size_t i) {
+                 try {
+                     thread_local encoder encode;
+                     thread_local string hit;
+                     const auto st = stats ? &(*stats)[i] : nullptr;
+                     fits[i] = string(il2fit(docs[i], encode, cache, hit, st,
+                                             inner));
+                 } catch (const exception& exn) {
+                     errors[i] = exn.what();
+                 }
+             },
+             [&](size_t i) {
+                 if (!errors[i].empty()) {
+                     cerr << "Document " << i << ": " << errors[i] << endl;
+                     ++failed;
+                     if (stats) {
+                         (*stats)[i].failed = true;
+                     }
+                 } else if (failed == 0) {
+                     const auto t0 = stats_clock::now();
+                     output.write(fits[i].data(), fits[i].size());
+                     if (stats) {
+                         (*stats)[i].output += seconds(stats_clock::now() - t0);
+                     }
+                 }
+                 fits[i] = string();
+             });
+
+    output.flush();
+    const bool written = static_cast<bool>(output);
+    if (!path.empty()) {
+        file.close();
+        if (failed > 0 || !written || !file) {
+            remove(path.c_str());
+        }
+    }
+    if (!written) {
+        error("Can't write output");
+    }
+    return failed;
+}
+
+// Output is written as it's encoded, so with stats its time is in the
+// write and close phases
+void
+il2fit_stream(string_view il, const string& path, doc_stats* stats)
+{
+    const auto counted = [&](const ostream_sink& out) {
+        if (stats) {
+            stats->bytes_out += out.written();
+        }
+    };
+    encoder encode;
+    reader input(il);
+    if (path.empty()) {
+        ostream_sink out(cout);
+        il2fit(input, encode, &out, stats);
+        counted(out);
+        return;
+    }
+
+    ofstream file(path, ios::out | ios::binary | ios::trunc);
+    try {
+        if (!file) {
+            error("Can't write \"" + path + "\"");
+        }
+        ostream_sink out(file);
+        il2fit(input, encode, &out, stats);
+        file.close();
+        if (!file) {
+            error("Can't write \"" + path + "\"");
+        }
+        counted(out);
+    } catch (...) {
+        file.close();
+        remove(path.c_str());
+        throw;
+    }
+}
+
+// FIT files to decode: path itself, or the .fit files under it. With an
+// output directory, each goes to an .il file at the same relative path,
+// otherwise to stdout.
+void
+read_tree(const string& path, const string& out_dir, vector<job>& jobs)
+{
+    const auto output = [&](const fs::path& rel) {
+        return out_dir.empty() ? string() :
+            (fs::path(out_dir) / rel).replace_extension(".il").string();
+    };
+
+    error_code ec;
+    if (path == "-" || !fs::is_directory(path, ec)) {
+        jobs.push_back({ path, path, "", output(fs::path(path).filename()) });
+        return;
+    }
+
+    vector<fs::path> found;
+    for (fs::recursive_directory_iterator it(path, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        const auto ext = it->path().extension();
+        if ((ext == ".fit" || ext == ".FIT") && it->is_regular_file(ec)) {
+            found.push_back(it->path());
+        }
+    }
+    if (ec) {
+        error("Can't read \"" + path + "\"");
+    }
+    sort(found.begin(), found.end());
+    for (const auto& p : found) {
+        jobs.push_back({ p.string(), p.string(), "",
+                    output(p.lexically_relative(path)) });
+    }
+}
+
+// Decode FIT files, on up to threads at once. IL for stdout comes out in
+// order, one document after another. Returns how many failed.
+size_t
+decode_all(const vector<job>& jobs, size_t threads)
+{
+    vector<string> ils(jobs.size());
+    vector<string> errors(jobs.size());
+    size_t failed = 0;
+    bool first = true;
+
+    parallel(threads, jobs.size(),
+             [&](size_t i) {
+                 try {
+                     const il_file file(jobs[i].path);
+                     if (jobs[i].output.empty()) {
+                         fit2il(file.data(), ils[i]);
+                         return;
+                     }
+                     thread_local string il;
+                     fit2il(file.data(), il);
+                     const fs::path out(jobs[i].output);
+                     fs::create_directories(out.parent_path());
+                     ofstream output(out, ios::out | ios::binary | ios::trunc);
+                     output.write(il.data(), il.size());
+                     output.close();
+                     if (!output) {
+                         error("Can't write \"" + jobs[i].output + "\"");
+                     }
+                 } catch (const exception& exn) {
+                     errors[i] = exn.what();
+                 }
+             },
+             [&](size_t i) {
+                 if (!errors[i].empty()) {
+                     cerr << jobs[i].name << ": " << errors[i] << endl;
+                     ++failed;
+                 } else if (jobs[i].output.empty()) {
+                     if (!first) {
+                         cout << "EOF\n";
+                     }
+                     cout << ils[i];
+                     first = false;
+                 }
+                 ils[i] = string();
+             });
+
+    if (!cout.flush()) {
+        error("Can't write output");
+    }
+    return failed;
+}
+
+// Check IL files, on up to threads at once. Returns how many failed.
+size_t
+check(const vector<string>& paths, size_t threads)
+{
+    vector<string> errors(paths.size());
+    size_t failed = 0;
+
+    parallel(threads, paths.size(),
+             [&](size_t i) {
+                 try {
+                     const il_file file(paths[i]);
+                     reader input(file.data());
+                     check(input);
+                 } catch (const exception& exn) {
+                     errors[i] = exn.what();
+                 }
+             },
+             [&](size_t i) {
+                 if (!errors[i].empty()) {
+                     cerr << paths[i] << ": " << errors[i] << endl;
+                     ++failed;
+                 }
+             });
+
+    return failed;
+}
+
+// Check FIT files, on up to threads at once. Returns how many failed.
+size_t
+verify(const vector<string>& paths, size_t threads)
+{
+    vector<string> errors(paths.size());
+    size_t failed = 0;
+
+    parallel(threads, paths.size(),
+             [&](size_t i) {
+                 try {
+                     const il_file file(paths[i]);
+                     ::verify(file.data());
+                 } catch (const exception& exn) {
+                     errors[i] = exn.what();
+                 }
+             },
+             [&](size_t i) {
+                 if (!errors[i].empty()) {
+                     cerr << paths[i] << ": " << errors[i] << endl;
+                     ++failed;
+                 }
+             });
+
+    return failed;
+}
+
+// Total, median, 99th percentile (nearest rank) and maximum of a phase
+// over documents, in nanoseconds
+void
+print_phase(ostream& out, const char* name, vector<double> t)
+{
+    const auto ns = [](double s) { return uint64_t(s * 1e9 + 0.5); };
+    const auto rank = [&](double p) {
+        return t[size_t(std::ceil(p * t.size())) - 1];
+    };
+    double total = 0;
+    for (const auto x : t) {
+        total += x;
+    }
+    sort(t.begin(), t.end());
+    out << '"' << name << "\":{\"total\":" << ns(total);
+    if (!t.empty()) {
+        out << ",\"p50\":" << ns(rank(0.5))
+            << ",\"p99\":" << ns(rank(0.99))
+            << ",\"max\":" << ns(t.back());
+    }
+    out << '}';
+}
+
+// One line of JSON for --stats. Phases and counters are over the
+// documents that converted, input is the time to read the input they
+// came from, if they came from one. Allocations are over the whole run,
+// on all threads.
+void
+print_stats(ostream& out, const vector<doc_stats>& docs, double wall,
+            double input)
+{
+    static constexpr const char* parse[doc_stats::kinds] = {
+        "parse.file_creator",
+        "parse.file_id",
+        "parse.workout",
+        "parse.workout_step"
+    };
+
+    vector<const doc_stats*> ok;
+    for (const auto& d : docs) {
+        if (!d.failed) {
+            ok.push_back(&d);
+        }
+    }
+    const auto times = [&](auto phase) {
+        vector<double> ans;
+        for (const auto d : ok) {
+            ans.push_back(phase(*d));
+        }
+        return ans;
+    };
+    const auto total = [&](auto counter) {
+        uint64_t ans = 0;
+        for (const auto d : ok) {
+            ans += counter(*d);
+        }
+        return ans;
+    };
+
+    out << "{\"documents\":" << docs.size()
+        << ",\"failed\":" << docs.size() - ok.size()
+        << ",\"cached\":" << total([](auto& d) { return d.cached; })
+        << ",\"wall_ns\":" << uint64_t(wall * 1e9 + 0.5)
+        << ",\"input_read_ns\":" << uint64_t(input * 1e9 + 0.5)
+        << ",\"phases_ns\":{";
+    print_phase(out, "read", times([](auto& d) { return d.read; }));
+    for (size_t k = 0; k < doc_stats::kinds; ++k) {
+        out << ',';
+        print_phase(out, parse[k], times([&](auto& d) { return d.parse[k]; }));
+    }
+    out << ',';
+    print_phase(out, "encode.write", times([](auto& d) { return d.write; }));
+    out << ',';
+    print_phase(out, "encode.close", times([](auto& d) { return d.close; }));
+    out << ',';
+    print_phase(out, "output", times([](auto& d) { return d.output; }));
+    out << ',';
+    print_phase(out, "document", times([](auto& d) {
+        double ans = d.read + d.write + d.close + d.output;
+        for (const auto p : d.parse) {
+            ans += p;
+        }
+        return ans;
+    }));
+    out << "},\"counters\":{"
+        << "\"tokens\":" << total([](auto& d) { return d.tokens; })
+        << ",\"messages\":" << total([](auto& d) {
+            size_t ans = 0;
+            for (const auto m : d.messages) {
+                ans += m;
+            }
+            return ans;
+        })
+        << ",\"steps\":" << total([](auto& d) {
+            return d.messages[doc_stats::kinds - 1]; // workout_step
+        })
+        << ",\"bytes_in\":" << total([](auto& d) { return d.bytes_in; })
+        << ",\"bytes_out\":" << total([](auto& d) { return d.bytes_out; })
+        << ",\"allocations\":" << allocations()
+        << "}}" << endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    string batch, cache_dir, list, output, socket;
+    vector<string> paths;
+    size_t cache_size = 256;
+    size_t threads = 1;
+    bool chained = false;
+    bool stream = false;
+    bool verify_fit = false;
+    bool check_il = false;
+    bool decode = false;
+    const auto env = getenv("IL2FIT_STATS");
+    bool stats = env && *env && string(env) != "0";
+    bool stats_opt = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const string opt = argv[i];
+        if (i + 1 < argc && opt == "--batch") {
+            batch = argv[++i];
+        } else if (i + 1 < argc && opt == "--list") {
+            list = argv[++i];
+        } else if (i + 1 < argc && (opt == "-o" || opt == "--output")) {
+            output = argv[++i];
+        } else if (i + 1 < argc && opt == "--serve") {
+            socket = argv[++i];
+        } else if (opt == "--chain") {
+            chained = true;
+        } else if (opt == "--stream") {
+            stream = true;
+        } else if (i + 1 < argc && opt == "--cache") {
+            cache_dir = argv[++i];
+        } else if (i + 1 < argc && opt == "--cache-size") {
+            istringstream iss(argv[++i]);
+            if (!(iss >> cache_size) || !iss.eof()) {
+                usage();
+                return 2;
+            }
+        } else if (i + 1 < argc && opt == "--jobs") {
+            const auto n = parse_jobs(argv[++i]);
+            if (!n) {
+                usage();
+                return 2;
+            }
+            threads = n.value();
+        } else if (opt == "--decode") {
+            decode = true;
+        } else if (opt == "--verify") {
+            verify_fit = true;
+        } else if (opt == "--check") {
+            check_il = true;
+        } else if (opt == "--stats") {
+            stats = stats_opt = true;
+        } else if (opt == "-" || opt.compare(0, 1, "-")) {
+            paths.push_back(opt);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (decode) {
+        if (!batch.empty() || !list.empty() || !socket.empty() ||
+            !cache_dir.empty() || chained || stream || verify_fit ||
+            check_il || stats_opt) {
+            usage();
+            return 2;
+        }
+        if (paths.empty()) {
+            paths.push_back("-");
+        }
+        try {
+            vector<job> jobs;
+            for (const auto& p : paths) {
+                read_tree(p, output, jobs);
+            }
+            return decode_all(jobs, threads) == 0 ? 0 : 1;
+        } catch (const exception& exn) {
+            cerr << exn.what() << endl;
+            return 1;
+        }
+    }
+
+    if (verify_fit || check_il) {
+        if (!batch.empty() || !list.empty() || !output.empty() ||
+            !socket.empty() || !cache_dir.empty() || chained || stream ||
+            stats_opt || (verify_fit && check_il)) {
+            usage();
+            return 2;
+        }
+        if (paths.empty()) {
+            paths.push_back("-");
+        }
+        const auto failed = verify_fit ? verify(paths, threads) :
+            check(paths, threads);
+        return failed == 0 ? 0 : 1;
+    }
+
+    if (paths.size() > 1) {
+        usage();
+        return 2;
+    }
+    const auto path = paths.empty() ? string() : paths.front();
+
+    if ((!batch.empty() + !list.empty() + !output.empty() +
+         !socket.empty()) > 1 ||
+        ((!list.empty() || !socket.empty()) && !path.empty()) ||
+        ((stream || chained) &&
+         (!batch.empty() || !list.empty() || !socket.empty())) ||
+        (stream && (chained || !cache_dir.empty())) ||
+        (stats_opt && !socket.empty())) {
+        usage();
+        return 2;
+    }
+
+    optional<fit_cache> cache_store;
+    fit_cache* cache = nullptr;
+    if (!cache_dir.empty()) {
+        try {
+            cache = &cache_store.emplace(cache_dir,
+                                         uintmax_t(cache_size) << 20);
+        } catch (const exception& exn) {
+            cerr << exn.what() << endl;
+            return 1;
+        }
+    }
+
+    if (!socket.empty()) {
+#ifdef __linux__
+        try {
+            // Workers live as long as the server, and keep their buffers
+            // from one request to the next
+            server(socket, threads, [cache](string_view il, string& fit) {
+                thread_local encoder encode;
+                thread_local string hit;
+                fit += il2fit(il, encode, cache, hit);
+            }).run();
+        } catch (const exception& exn) {
+            cerr << exn.what() << endl;
+            return 1;
+        }
+        return 0;
+#else
+        cerr << "--serve is only supported on Linux" << endl;
+        return 2;
+#endif
+    }
+
+    if (stats) {
+        count_allocations(true);
+    }
+    const auto start = stats_clock::now();
+    vector<doc_stats> docs;
+    double input_read = 0;
+    const auto done = [&](int status) {
+        if (stats) {
+            print_stats(cerr, docs,
+                        seconds(stats_clock::now() - start), input_read);
+        }
+        return status;
+    };
+    const auto read_input = [&](optional<il_file>& file) {
+        const auto t0 = stats_clock::now();
+        file.emplace(path);
+        input_read = seconds(stats_clock::now() - t0);
+    };
+
+    if (!batch.empty() || !list.empty()) {
+        optional<il_file> file; // Jobs refer into it
+        vector<job> jobs;
+        try {
+            if (!batch.empty()) {
+                read_input(file);
+                reader input(file->data());
+                read_batch(input, batch, jobs);
+            } else if (list == "-") {
+                read_list(cin, jobs);
+            } else {
+                ifstream paths(list);
+                if (!paths) {
+                    error("Can't read \"" + list + "\"");
+                }
+                read_list(paths, jobs);
+            }
+        } catch (const exception& exn) {
+            cerr << exn.what() << endl;
+            return 1;
+        }
+        const auto failed = convert(jobs, threads, cache,
+                                    stats ? &docs : nullptr);
+        return done(failed == 0 ? 0 : 1);
+    }
+
+    if (chained) {
+        try {
+            optional<il_file> file;
+            read_input(file);
+            reader input(file->data());
+            const auto failed = chain(input, output, threads, cache,
+                                      stats ? &docs : nullptr);
+            return done(failed == 0 ? 0 : 1);
+        } catch (const exception& exn) {
+            cerr << exn.what() << endl;
+            return done(1);
+        }
+    }
+
+    if (stats) {
+        docs.resize(1);
+    }
+    const auto st = stats ? &docs.front() : nullptr;
+    try {
+        optional<il_file> file;
+        read_input(file);
+        if (st) {
+            st->read = input_read;
+            input_read = 0;
+        }
+        if (stream) {
+            il2fit_stream(file->data(), output, st);
+        } else if (output.empty()) {
+            il2fit_stdout(file->data(), cache, st, threads);
+        } else {
+            il2fit(file->data(), output, cache, st, threads);
+        }
+    } catch (const exception& exn) {
+        cerr << exn.what() << endl;
+        if (st) {
+            st->failed = true;
+        }
+        return done(1);
+    }
+
+    return done(0);
+}
+
+#elif defined(_WITH_TESTS)
+
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+namespace {
+
+// Binary IL building blocks
+string
+bin_record(unsigned m, const string& payload)
+{
+    return string{ char(m), char(payload.size()), char(payload.size() >> 8) } +
+        payload;
+}
+
+string
+bin_u32(unsigned k, uint32_t v)
+{
+    return string{ char(k), char(v), char(v >> 8), char(v >> 16),
+            char(v >> 24) };
+}
+
+string
+bin_f32(unsigned k, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    return bin_u32(k, v);
+}
+
+string
+bin_str(unsigned k, string_view s)
+{
+    return string{ char(k), char(s.size()) } + string(s);
+}
+
+} // namespace
+
+//----------------------------------------------------------------------------
+// Cases for trim()
+
+TEST_CASE("Trim empty string", "[trim]")
+{
+    CHECK(trim("") == "");
+}
+
+TEST_CASE("Trim string, empty ans", "[trim]")
+{
+    CHECK(trim(" \t\t ") == "");
+}
+
+TEST_CASE("Trim string left", "[trim]")
+{
+    CHECK(trim(" \tabc") == "abc");
+}
+
+TEST_CASE("Trim string right", "[trim]")
+{
+    CHECK(trim("abc\t ") == "abc");
+}
+
+TEST_CASE("Trim left and right", "[trim]")
+{
+    CHECK(trim(" \tabc\t ") == "abc");
+}
+
+//----------------------------------------------------------------------------
+// Cases for line()
+
+TEST_CASE("EOF on empty input", "[line]")
+{
+    istringstream input;
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Empty line", "[line]")
+{
+    istringstream input("\n");
+    CHECK(line(input) == some(string("")));
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Incomplete line", "[line]")
+{
+    istringstream input("abc");
+    CHECK(line(input) == some(string("abc")));
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Single complete line", "[line]")
+{
+    istringstream input("abc\n");
+    CHECK(line(input) == some(string("abc")));
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Multiple lines", "[line]")
+{
+    istringstream input("abc\ndef\n");
+    CHECK(line(input) == some(string("abc")));
+    CHECK(line(input) == some(string("def")));
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Lines from buffer", "[line]")
+{
+    reader input("abc\n\ndef");
+    CHECK(line(input) == some(string_view("abc")));
+    CHECK(line(input) == some(string_view("")));
+    CHECK(line(input) == some(string_view("def")));
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("EOF on empty buffer", "[line]")
+{
+    reader input("");
+    CHECK(line(input) == none);
+}
+
+TEST_CASE("Read whole stream", "[line]")
+{
+    const string s(100000, 'x');
+    istringstream input(s);
+    CHECK(contents(input) == s);
+    CHECK(contents(input).empty());
+}
+
+//----------------------------------------------------------------------------
+// Cases for il_file
+
+TEST_CASE("Read IL file", "[il_file]")
+{
+    const string path = "il2fit-test.il";
+    const string text = "begin\nworkout\nend\nworkout\n";
+    ofstream(path, ios::out | ios::binary) << text;
+    {
+        const il_file file(path);
+        CHECK(file.data() == text);
+    }
+    ofstream(path, ios::out | ios::binary | ios::trunc);
+    {
+        const il_file file(path);
+        CHECK(file.data().empty());
+    }
+    remove(path.c_str());
+    CHECK_THROWS_AS(il_file(path), runtime_error);
+}
+
+//----------------------------------------------------------------------------
+// Cases for value()
+
+TEST_CASE("Error on empty input", "[value]")
+{
+    istringstream input;
+    CHECK_THROWS_AS(value<string>(input), runtime_error);
+}
+
+TEST_CASE("Parse string value", "[value]")
+{
+    istringstream input("abc\n");
+    CHECK(value<string>(input) == "abc");
+}
+
+TEST_CASE("Parse string value with padding", "[value]")
+{
+    istringstream input(" abc\t\t\n");
+    CHECK(value<string>(input) == "abc");
+}
+
+TEST_CASE("Parse int value", "[value]")
+{
+    istringstream input("123\n");
+    CHECK(value<int>(input) == 123);
+}
+
+TEST_CASE("Parse double value", "[value]")
+{
+    istringstream input("45.6\n");
+    CHECK(value<double>(input) == Approx(45.6));
+}
+
+TEST_CASE("Parse values from buffer", "[value]")
+{
+    reader input(" abc\t\n150\n+7\n31.5\n");
+    CHECK(value<string_view>(input) == "abc");
+    CHECK(value<FIT_UINT8>(input) == 150);
+    CHECK(value<int>(input) == 7);
+    CHECK(value<float>(input) == Approx(31.5));
+    CHECK_THROWS_AS(value<int>(input), runtime_error);
+}
+
+TEST_CASE("Bad syntax", "[value]")
+{
+    reader input("12abc\n-1\n\n");
+    CHECK_THROWS_AS(value<int>(input), runtime_error);
+    CHECK_THROWS_AS(value<unsigned>(input), runtime_error);
+    CHECK_THROWS_AS(value<int>(input), runtime_error);
+}
+
+namespace {
+
+// Message of the error f throws
+template <class F>
+string
+error_of(F&& f)
+{
+    try {
+        f();
+    } catch (const runtime_error& exn) {
+        return exn.what();
+    }
+    return "";
+}
+
+} // namespace
+
+TEST_CASE("Digits as from_chars reads them", "[value][digits]")
+{
+    const char* tokens[] = {
+        "", "0", "7", "42", "0007", "255", "256", "65535", "65536",
+        "4294967295", "4294967296", "1234567890123456", "12345678901234567",
+        "9999999999999999", "-1", "1-", "12a", " 1", "1 ", "/", ":", "1.5",
+        "\xb0", "+5"
+    };
+    for (const string_view t : tokens) {
+        uint64_t n = 0;
+        const auto r = from_chars(t.data(), t.data() + t.size(), n);
+        const auto ok = r.ec == errc() && r.ptr == t.data() + t.size() &&
+            t.size() <= 16 && t.substr(0, 1) != "+";
+        // Loaded in place when there's room after the token, with
+        // whatever follows it
+        const auto padded = string(t) + "9.9.9.9.9.9.9.9.";
+        const auto in_place = string_view(padded).substr(0, t.size());
+        CHECK(digits_scalar(t).has_value() == ok);
+        CHECK(digits(t, t.size()).has_value() == ok);
+        CHECK(digits(in_place, padded.size()).has_value() == ok);
+        if (ok) {
+            CHECK(digits_scalar(t).value() == n);
+            CHECK(digits(t, t.size()).value() == n);
+            CHECK(digits(in_place, padded.size()).value() == n);
+        }
+    }
+
+    // Not past the end of the input
+    reader input("1234567");
+    CHECK(value<FIT_UINT32>(input) == 1234567);
+
+    // Fast path or not, same values and errors
+    CHECK(parse<FIT_UINT8>("255") == 255);
+    CHECK(parse<FIT_UINT16>("+65535") == 65535);
+    CHECK(parse<FIT_UINT32>("4294967295") == 4294967295u);
+    CHECK(error_of([] { parse<FIT_UINT8>("256"); }) ==
+          "Bad syntax near \"256\"");
+    CHECK(error_of([] { parse<FIT_UINT32>("12x"); }) ==
+          "Bad syntax near \"12x\"");
+    CHECK(error_of([] { parse<FIT_UINT32>(""); }) == "Bad syntax near \"\"");
+}
+
+TEST_CASE("Floats as from_chars reads them", "[value][digits]")
+{
+    const char* tokens[] = {
+        "0", "31.5", "0.1", "2.25", "16777216", "16777217", "1234.5678",
+        "0.0000000001", "0.00000000001", ".5", "5.", "3.", "1e3", "-2.5",
+        "inf", "nan", "1.2.3", ".", "", "99999.99", "0.3333333333"
+    };
+    for (const string_view t : tokens) {
+        float x = 0;
+        const auto r = from_chars(t.data(), t.data() + t.size(), x);
+        if (r.ec != errc() || r.ptr != t.data() + t.size()) {
+            CHECK(error_of([&] { parse<float>(t); }) ==
+                  "Bad syntax near \"" + string(t) + "\"");
+        } else if (t != "nan") {
+            CHECK(parse<float>(t) == x);
+        }
+        if (const auto y = decimal_float(t)) {
+            CHECK(*y == x);
+        }
+        const auto a = decimal_scalar(t);
+        const auto b = decimal_of(t, t.size());
+        const auto padded = string(t) + "9.9.9.9.9.9.9.9.";
+        const auto c = decimal_of(string_view(padded).substr(0, t.size()),
+                                  padded.size());
+        CHECK(a.has_value() == b.has_value());
+        CHECK(a.has_value() == c.has_value());
+        if (a && b && c) {
+            CHECK(a.value().digits == b.value().digits);
+            CHECK(a.value().places == b.value().places);
+            CHECK(a.value().digits == c.value().digits);
+            CHECK(a.value().places == c.value().places);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Cases for value() with range
+
+TEST_CASE("Parse value with range", "[value]")
+{
+    istringstream input("55\n");
+    CHECK(value<int>(input, 0, 100) == 55);
+}
+
+TEST_CASE("Parse value out of range", "[value]")
+{
+    istringstream input("55\n");
+    CHECK_THROWS_AS(value<int>(input, 0, 10), runtime_error);
+}
+
+TEST_CASE("Parse value, range endpoints out of order", "[value]")
+{
+    istringstream input("55\n");
+    CHECK(value<int>(input, 100, 0) == 55);
+}
+
+TEST_CASE("Parse value, range pair", "[value]")
+{
+    istringstream input("55\n55\n");
+    CHECK(value<int>(input, 0, 100) ==
+          value<int>(input, make_pair(0, 100)));
+}
+
+//----------------------------------------------------------------------------
+// Cases for value() for enumerations
+
+TEST_CASE("Parse enum value", "[value]")
+{
+    reader input("xyz\n");
+    CHECK(value<int>(input, make_table<int>({
+                { "xyz", 10 },
+                { "abc", 12 }
+            })) == 10);
+}
+
+TEST_CASE("Parse enum value, invalid token", "[value]")
+{
+    reader input("xyz\n");
+    CHECK_THROWS_AS(value<int>(input, make_table<int>({
+                { "abc", 20 },
+                { "def", 30 }
+            })), runtime_error);
+}
+
+//----------------------------------------------------------------------------
+// Cases for table
+
+TEST_CASE("Find all keys", "[table]")
+{
+    static constexpr auto t = make_table<int>({
+            { "a", 1 }, { "b", 2 }, { "ab", 3 }, { "ba", 4 }, { "", 5 },
+            { "abc", 6 }, { "acb", 7 }, { "bac", 8 }, { "bca", 9 }
+        });
+    CHECK(*t.find("a") == 1);
+    CHECK(*t.find("ba") == 4);
+    CHECK(*t.find("") == 5);
+    CHECK(*t.find("bca") == 9);
+    CHECK(t.find("c") == nullptr);
+    CHECK(t.find("abcd") == nullptr);
+    static_assert(t["acb"] == 7, "Lookup at compile time");
+}
+
+//----------------------------------------------------------------------------
+// Cases for match()
+
+TEST_CASE("No match in table", "[match]")
+{
+    reader input("xyz\n\nabc\n");
+    static constexpr auto keys = keywords({ "foo", "bar" });
+    CHECK_THROWS_AS(match(input, keys), runtime_error);
+    CHECK_THROWS_AS(match(input, keys), runtime_error);
+    CHECK_THROWS_AS(match(input, keys), runtime_error);
+}
+
+TEST_CASE("Match table", "[match]")
+{
+    reader input("xyz\nabc\n");
+    static constexpr auto keys = keywords({ "abc", "xyz" });
+    CHECK(match(input, keys) == keys["xyz"]);
+    CHECK(match(input, keys) == keys["abc"]);
+}
+
+TEST_CASE("Expect keyword", "[match]")
+{
+    reader input("workout\nworkout_step\n");
+    CHECK_NOTHROW(expect(input, "workout"));
+    CHECK_THROWS_AS(expect(input, "workout"), runtime_error);
+}
+
+//----------------------------------------------------------------------------
+// Cases for value<file_creator_mesg>
+
+TEST_CASE("Valid file_creator", "[file_creator][value]")
+{
+    reader input(
+        "hardware_version\n"
+        "150\n"
+        "software_version\n"
+        "330\n"
+        "end\n"
+        "file_creator\n"
+        );
+    CHECK_NOTHROW(value<file_creator_mesg>(input));
+}
+
+//----------------------------------------------------------------------------
+// Cases for value<file_id_mesg>
+
+TEST_CASE("Valid file_id", "[file_id][value]")
+{
+    reader input(
+        "time_created\n"
+        "1457736704\n"
+        "serial_number\n"
+        "2501\n"
+        "number\n"
+        "5\n"
+        "end\n"
+        "file_id\n"
+        );
+    CHECK_NOTHROW(value<file_id_mesg>(input));
+}
+
+//----------------------------------------------------------------------------
+// Cases for value<workout_mesg>
+
+TEST_CASE("Valid workout", "[value][workout]")
+{
+    reader input(
+        "wkt_name\n"
+        "Tempo\n"
+        "sport\n"
+        "fishing\n"
+        "num_valid_steps\n"
+        "15\n"
+        "capabilities\n"
+        "31\n"
+        "end\n"
+        "workout\n"
+        );
+    CHECK_NOTHROW(value<workout_mesg>(input));
+}
+
+//----------------------------------------------------------------------------
+// Cases for value<workout_step_mesg>
+
+TEST_CASE("Valid workout_step", "[value][workout_step]")
+{
+    reader input(
+        "message_index\n"
+        "3\n"
+        "wkt_step_name\n"
+        "Intro\n"
+        "intensity\n"
+        "warmup\n"
+        "duration_time\n"
+        "31.5\n"
+        "target_value\n"
+        "0\n"
+        "custom_target_heart_rate_low\n"
+        "50\n"
+        "custom_target_heart_rate_high\n"
+        "270\n"
+        "end\n"
+        "workout_step\n"
+        );
+    CHECK_NOTHROW(value<workout_step_mesg>(input));
+}
+
+TEST_CASE("Keys set fields at their slots", "[value][workout_step]")
+{
+    using namespace workout_step;
+
+    reader input(
+        "intensity\n"
+        "rest\n"
+        "duration_time\n"
+        "1.5\n"
+        "duration_step\n"
+        "2\n"
+        "end\n"
+        "workout_step\n"
+        );
+    const auto m = value<workout_step_mesg>(input);
+
+    // Defaults first, then in the order keys were first read
+    const FIT_UINT8 order[] = {
+        message_index.num, duration_type.num, target_type.num, intensity.num,
+        duration_value.num
+    };
+    REQUIRE(size_t(m.end() - m.begin()) == std::size(order));
+    CHECK(std::equal(m.begin(), m.end(), order,
+                     [](const field& f, FIT_UINT8 num) {
+                         return f.num == num;
+                     }));
+    REQUIRE(m.get(duration_value.slot));
+    CHECK(m.get(duration_value.slot)->number == 2);
+    CHECK(m.get(intensity.slot)->number == FIT_INTENSITY_REST);
+    CHECK(m.get(wkt_step_name.slot) == nullptr);
+
+    // Binary IL numbers keys by position, so their order is fixed
+    CHECK(keywords(keys)["duration_time"] == 15);
+    CHECK(keywords(keys)["end"] == std::size(keys));
+}
+
+//----------------------------------------------------------------------------
+// Cases for il2fit
+
+TEST_CASE("Fail on empty IL input", "[il2fit]")
+{
+    reader input("");
+    encoder output;
+    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+}
+
+TEST_CASE("Invalid IL input", "[il2fit]")
+{
+    reader input(
+        "begin\n"
+        "nonsense\n"
+        "end\n"
+        "nonsense\n"
+        );
+    encoder output;
+    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+}
+
+TEST_CASE("Errors give the line and message block", "[il2fit]")
+{
+    const auto error_in = [](const string& il) {
+        return error_of([&] {
+                reader input(il);
+                encoder output;
+                il2fit(input, output);
+            });
+    };
+
+    CHECK(error_in("nonsense\n") == "Bad token \"nonsense\" at line 1");
+    CHECK(error_in("begin\nnonsense\n") ==
+          "Bad token \"nonsense\" at line 2, in block 1");
+    CHECK(error_in("begin\nworkout\nwkt_name\n") ==
+          "Unexpected end of file at line 3, in block 1 (workout)");
+    CHECK(error_in("begin\nworkout\nend\nworkout\n"
+                   "begin\nworkout_step\nintensity\nhard\n") ==
+          "Invalid enum value \"hard\" at line 8, in block 2 (workout_step)");
+    CHECK(error_in("begin\nworkout\nend\nfile_id\n") ==
+          "Bad token \"file_id\" at line 4, in block 1 (workout)");
+
+    const auto magic = binary_magic.size();
+    CHECK(error_in(string(binary_magic) + bin_record(9, "")) ==
+          S("Bad message 9 at byte " << magic + 3 << ", in block 1"));
+    CHECK(error_in(string(binary_magic) + bin_record(2, "") +
+                   bin_record(3, bin_u32(19, 5000))) ==
+          S("Value 5000 is out of range [0, 4095] at byte " << magic + 11
+            << ", in block 2 (workout_step)"));
+}
+
+TEST_CASE("Valid IL input", "[il2fit]")
+{
+    reader input(
+        "begin\n"
+        "file_id\n"
+        "end\n"
+        "file_id\n"
+        "begin\n"
+        "file_creator\n"
+        "end\n"
+        "file_creator\n"
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n"
+        "begin\n"
+        "workout_step\n"
+        "end\n"
+        "workout_step\n"
+        );
+    encoder output;
+    CHECK_NOTHROW(il2fit(input, output));
+    CHECK_FALSE(output.data().empty());
+}
+
+TEST_CASE("FIT header and CRC", "[il2fit]")
+{
+    reader input(
+        "begin\n"
+        "file_id\n"
+        "end\n"
+        "file_id\n"
+        );
+    encoder output;
+    il2fit(input, output);
+    const auto data = output.data();
+    REQUIRE(data.size() > FIT_FILE_HDR_SIZE + 2);
+    CHECK(data[0] == FIT_FILE_HDR_SIZE);
+    CHECK(data.substr(8, 4) == ".FIT");
+    CHECK(crc16(0, data.substr(0, FIT_FILE_HDR_SIZE)) == 0);
+    CHECK(crc16(0, data) == 0);
+    FIT_UINT32 size = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        size |= FIT_UINT32(static_cast<unsigned char>(data[4 + i])) << (8 * i);
+    }
+    CHECK(size == data.size() - FIT_FILE_HDR_SIZE - 2);
+}
+
+TEST_CASE("Same bytes as fit::Encode", "[il2fit]")
+{
+    reader input(
+        "begin\n"
+        "file_id\n"
+        "time_created\n"
+        "1457736704\n"
+        "serial_number\n"
+        "2501\n"
+        "end\n"
+        "file_id\n"
+        "begin\n"
+        "workout\n"
+        "wkt_name\n"
+        "Tempo\n"
+        "sport\n"
+        "running\n"
+        "num_valid_steps\n"
+        "3\n"
+        "end\n"
+        "workout\n"
+        "begin\n"
+        "workout_step\n"
+        "message_index\n"
+        "0\n"
+        "wkt_step_name\n"
+        "Warm up\n"
+        "duration_time\n"
+        "600.5\n"
+        "custom_target_speed_low\n"
+        "2.5\n"
+        "custom_target_speed_high\n"
+        "3.25\n"
+        "end\n"
+        "workout_step\n"
+        "begin\n"
+        "workout_step\n"
+        "message_index\n"
+        "1\n"
+        "duration_distance\n"
+        "1000\n"
+        "end\n"
+        "workout_step\n"
+        "begin\n"
+        "workout_step\n"
+        "message_index\n"
+        "2\n"
+        "wkt_step_name\n"
+        "Cool down, slowly\n"
+        "end\n"
+        "workout_step\n"
+        );
+    encoder output;
+    il2fit(input, output);
+
+    // Same defaults and order of setters as the IL parsers
+    fit::FileIdMesg file_id;
+    file_id.SetType(FIT_FILE_WORKOUT);
+    file_id.SetManufacturer(FIT_MANUFACTURER_GARMIN);
+    file_id.SetProduct(FIT_GARMIN_PRODUCT_EDGE500);
+    file_id.SetSerialNumber(2501);
+    file_id.SetTimeCreated(1457736704);
+    fit::WorkoutMesg workout;
+    workout.SetSport(FIT_SPORT_RUNNING);
+    workout.SetCapabilities(FIT_WORKOUT_CAPABILITIES_INVALID);
+    workout.SetNumValidSteps(3);
+    workout.SetWktName(L"Tempo");
+    fit::WorkoutStepMesg steps[3];
+    for (auto& step : steps) {
+        step.SetMessageIndex(FIT_MESSAGE_INDEX_INVALID);
+        step.SetDurationType(FIT_WKT_STEP_DURATION_OPEN);
+        step.SetTargetType(FIT_WKT_STEP_TARGET_OPEN);
+    }
+    steps[0].SetMessageIndex(0);
+    steps[0].SetWktStepName(L"Warm up");
+    steps[0].SetDurationTime(600.5);
+    steps[0].SetCustomTargetSpeedLow(2.5);
+    steps[0].SetCustomTargetSpeedHigh(3.25);
+    steps[1].SetMessageIndex(1);
+    steps[1].SetDurationDistance(1000);
+    steps[2].SetMessageIndex(2);
+    steps[2].SetWktStepName(L"Cool down, slowly");
+
+    stringstream expected(ios::in | ios::out | ios::binary);
+    fit::Encode encode(fit::ProtocolVersion::V10);
+    encode.Open(expected);
+    encode.Write(file_id);
+    encode.Write(workout);
+    for (const auto& step : steps) {
+        encode.Write(step);
+    }
+    REQUIRE(encode.Close());
+
+    CHECK(output.data() == expected.str());
+}
+
+TEST_CASE("Long names are cut between UTF-8 characters", "[il2fit]")
+{
+    const auto cut = [](const string& s) {
+        return string(text(field{ 0, FIT_BASE_TYPE_STRING, 0, 0, s }));
+    };
+    const string a(252, 'a');
+    CHECK(cut(a + "\xC3\xA9") == a + "\xC3\xA9");
+    CHECK(cut(a + "\xC3\xA9" "b") == a + "\xC3\xA9");
+    CHECK(cut(a + "b\xC3\xA9") == a + "b");
+    CHECK(cut(a + "\xE2\x82\xAC") == a);
+    CHECK(cut(string(300, 'a')) == string(254, 'a'));
+
+    const auto il =
+        "begin\n"
+        "workout\n"
+        "wkt_name\n" + a + "b\xE2\x82\xAC\n"
+        "end\n"
+        "workout\n";
+    reader input(il);
+    encoder output;
+    il2fit(input, output);
+    string back;
+    fit2il(output.data(), back);
+    CHECK(back.find("wkt_name\n" + a + "b\n") != string::npos);
+}
+
+TEST_CASE("Negative scaled values", "[il2fit]")
+{
+    const auto step = [](const string& time) {
+        const auto il = "duration_time\n" + time + "\nend\nworkout_step\n";
+        reader input(il);
+        return value<workout_step_mesg>(input);
+    };
+    // fit::Encode wrapped these around, now they're errors
+    CHECK(error_of([&] { step("-1"); }) == "Value -1 is out of range");
+    // Those that round to 0 are still 0
+    const auto m = step("-0.0004");
+    REQUIRE(m.get(workout_step::duration_value.slot));
+    CHECK(m.get(workout_step::duration_value.slot)->number == 0);
+}
+
+//----------------------------------------------------------------------------
+// Cases for binary IL
+
+TEST_CASE("Binary IL is detected", "[binary]")
+{
+    CHECK_FALSE(reader("begin\n").binary);
+    CHECK(reader(binary_magic).binary);
+    CHECK(reader(binary_magic).pos == binary_magic.size());
+}
+
+TEST_CASE("Binary and text IL give the same FIT", "[binary][il2fit]")
+{
+    reader text(
+        "begin\n"
+        "file_id\n"
+        "end\n"
+        "file_id\n"
+        "begin\n"
+        "workout\n"
+        "wkt_name\n"
+        "Tempo\n"
+        "sport\n"
+        "running\n"
+        "num_valid_steps\n"
+        "1\n"
+        "end\n"
+        "workout\n"
+        "begin\n"
+        "workout_step\n"
+        "message_index\n"
+        "0\n"
+        "duration_type\n"
+        "time\n"
+        "duration_time\n"
+        "600.5\n"
+        "target_type\n"
+        "open\n"
+        "intensity\n"
+        "warmup\n"
+        "end\n"
+        "workout_step\n"
+        );
+    const auto il =
+        string(binary_magic) +
+        bin_record(1, "") +
+        bin_record(2, bin_str(3, "Tempo") + bin_str(2, "running") +
+                   bin_u32(1, 1)) +
+        bin_record(3, bin_u32(19, 0) + bin_str(16, "time") +
+                   bin_f32(15, 600.5) + bin_str(28, "open") +
+                   bin_str(18, "warmup"));
+    reader binary(il);
+
+    encoder expected, output;
+    il2fit(text, expected);
+    il2fit(binary, output);
+    CHECK(output.data() == expected.data());
+}
+
+TEST_CASE("Binary value out of range", "[binary][il2fit]")
+{
+    const auto il = string(binary_magic) + bin_record(0, bin_u32(0, 256));
+    reader input(il);
+    encoder output;
+    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+}
+
+TEST_CASE("Truncated binary record", "[binary][il2fit]")
+{
+    const auto il = string(binary_magic) + bin_record(2, bin_u32(1, 5));
+    reader input(string_view(il).substr(0, il.size() - 1));
+    encoder output;
+    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+}
+
+TEST_CASE("Bad binary field", "[binary][il2fit]")
+{
+    const auto il = string(binary_magic) + bin_record(2, bin_u32(7, 5));
+    reader input(il);
+    encoder output;
+    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+}
+
+//----------------------------------------------------------------------------
+// Cases for streaming
+
+namespace {
+
+// Enough steps for several chunks
+string
+long_workout()
+{
+    string ans = "begin\nworkout\nwkt_name\nLong\nend\nworkout\n";
+    for (int i = 0; i < 4000; ++i) {
+        ans += "begin\nworkout_step\nmessage_index\n" + std::to_string(i) +
+            "\nwkt_step_name\nStep " + std::to_string(i) +
+            "\nduration_time\n60\nend\nworkout_step\n";
+    }
+    return ans;
+}
+
+// Can't seek, as pipes
+class pipe_buf : public std::stringbuf
+{
+protected:
+    pos_type
+    seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override
+    {
+        return pos_type(off_type(-1));
+    }
+};
+
+} // namespace
+
+TEST_CASE("Stream to a seekable output", "[il2fit][stream]")
+{
+    const auto il = long_workout();
+    reader input(il);
+    encoder whole;
+    il2fit(input, whole);
+    REQUIRE(whole.data().size() > encoder::chunk_size);
+
+    stringstream out;
+    out << "prefix";
+    ostream_sink sink(out);
+    CHECK(sink.seekable());
+    reader again(il);
+    encoder encode;
+    il2fit(again, encode, &sink);
+    CHECK(out.str() == "prefix" + string(whole.data()));
+}
+
+TEST_CASE("Stream to a pipe", "[il2fit][stream]")
+{
+    const auto il = long_workout();
+    reader input(il);
+    encoder whole;
+    il2fit(input, whole);
+    REQUIRE(whole.data().size() > encoder::chunk_size);
+
+    pipe_buf buf;
+    ostream out(&buf);
+    ostream_sink sink(out);
+    CHECK_FALSE(sink.seekable());
+    reader again(il);
+    encoder encode;
+    il2fit(again, encode, &sink);
+    CHECK(buf.str() == whole.data());
+    CHECK(sink.written() == whole.data().size());
+}
+
+TEST_CASE("Stats for a document", "[il2fit][stats]")
+{
+    const auto il = long_workout();
+    reader input(il);
+    encoder encode;
+    doc_stats stats;
+    il2fit(input, encode, nullptr, &stats);
+    CHECK(stats.messages[0] == 0);
+    CHECK(stats.messages[1] == 0);
+    CHECK(stats.messages[2] == 1);
+    CHECK(stats.messages[3] == 4000);
+    CHECK(stats.tokens == size_t(std::count(il.begin(), il.end(), '\n')));
+    CHECK(stats.bytes_in == il.size());
+    CHECK(stats.parse[3] > 0);
+    CHECK(stats.write > 0);
+
+    // The same without stats
+    reader again(il);
+    encoder plain;
+    il2fit(again, plain);
+    CHECK(plain.data() == encode.data());
+
+    const auto bin = string(binary_magic) + bin_record(1, "") +
+        bin_record(2, bin_str(3, "W") + bin_u32(1, 5));
+    reader binary(bin);
+    doc_stats bin_stats;
+    il2fit(binary, encode, nullptr, &bin_stats);
+    CHECK(bin_stats.messages[1] == 1);
+    CHECK(bin_stats.messages[2] == 1);
+    CHECK(bin_stats.tokens == 2);
+}
+
+//----------------------------------------------------------------------------
+// Cases for verify()
+
+namespace {
+
+// Warm up twice, then repeat both steps three times
+const string repeats_il =
+    "begin\n"
+    "workout\n"
+    "num_valid_steps\n"
+    "3\n"
+    "end\n"
+    "workout\n"
+    "begin\n"
+    "workout_step\n"
+    "message_index\n"
+    "0\n"
+    "duration_time\n"
+    "60\n"
+    "end\n"
+    "workout_step\n"
+    "begin\n"
+    "workout_step\n"
+    "message_index\n"
+    "1\n"
+    "duration_time\n"
+    "60\n"
+    "end\n"
+    "workout_step\n"
+    "begin\n"
+    "workout_step\n"
+    "message_index\n"
+    "2\n"
+    "duration_type\n"
+    "repeat_until_steps_cmplt\n"
+    "duration_step\n"
+    "0\n"
+    "repeat_steps\n"
+    "3\n"
+    "end\n"
+    "workout_step\n";
+
+string
+fit_of(const string& il)
+{
+    reader input(il);
+    encoder encode;
+    il2fit(input, encode);
+    return string(encode.data());
+}
+
+string
+replaced(string s, const string& from, const string& to)
+{
+    const auto pos = s.find(from);
+    REQUIRE(pos != string::npos);
+    return s.replace(pos, from.size(), to);
+}
+
+} // namespace
+
+TEST_CASE("Verify FIT", "[verify]")
+{
+    const auto fit = fit_of(repeats_il);
+    CHECK_NOTHROW(verify(fit));
+    CHECK_NOTHROW(verify(fit + fit));
+    CHECK_NOTHROW(wrked::verify(fit));
+}
+
+TEST_CASE("Verify broken FIT", "[verify]")
+{
+    const auto fit = fit_of(repeats_il);
+    CHECK_THROWS_AS(verify(""), runtime_error);
+    CHECK_THROWS_AS(verify("Not a FIT file"), runtime_error);
+    CHECK_THROWS_AS(verify(fit.substr(0, fit.size() - 1)), runtime_error);
+    CHECK_THROWS_AS(verify(fit + fit.substr(0, 20)), runtime_error);
+
+    auto damaged = fit;
+    damaged[20] ^= 1;
+    CHECK_THROWS_AS(verify(damaged), runtime_error);
+}
+
+TEST_CASE("Verify workout steps", "[verify]")
+{
+    // Missing, repeated and forward steps, and a wrong count
+    const auto skipped = replaced(repeats_il, "message_index\n1\n",
+                                  "message_index\n5\n");
+    CHECK_THROWS_AS(verify(fit_of(skipped)), runtime_error);
+    const auto forward = replaced(repeats_il, "duration_step\n0\n",
+                                  "duration_step\n2\n");
+    CHECK_THROWS_AS(verify(fit_of(forward)), runtime_error);
+    const auto count = replaced(repeats_il, "num_valid_steps\n3\n",
+                                "num_valid_steps\n4\n");
+    CHECK_THROWS_AS(verify(fit_of(count)), runtime_error);
+}
+
+//----------------------------------------------------------------------------
+// Cases for count_allocations()
+
+namespace {
+
+// Calls rather than new expressions, which may be left out
+void
+allocate(int n)
+{
+    for (int i = 0; i < n; ++i) {
+        operator delete(operator new(8));
+    }
+}
+
+} // namespace
+
+TEST_CASE("Count allocations on every thread", "[alloc]")
+{
+    count_allocations(true);
+    auto before = allocations();
+    allocate(3);
+    thread(allocate, 5).join();
+    thread(allocate, 7).join();
+    CHECK(allocations() - before >= 15);
+
+    count_allocations(false);
+    before = allocations();
+    allocate(3);
+    thread(allocate, 5).join();
+    CHECK(allocations() == before);
+    count_allocations(true);
+}
+
+//----------------------------------------------------------------------------
+// Cases for check()
+
+TEST_CASE("Check IL", "[check]")
+{
+    reader input(repeats_il);
+    count_allocations(true);
+    const auto before = allocations();
+    CHECK_NOTHROW(check(input));
+    CHECK(allocations() == before);
+    CHECK_NOTHROW(wrked::check(repeats_il));
+}
+
+TEST_CASE("Check steps across messages", "[check]")
+{
+    const auto error_in = [](const string& il) {
+        return error_of([&] { wrked::check(il); });
+    };
+
+    // What il2fit() converts, without complaint
+    const auto count = replaced(repeats_il, "num_valid_steps\n3\n",
+                                "num_valid_steps\n4\n");
+    CHECK_NOTHROW(fit_of(count));
+    CHECK(error_in(count) ==
+          "Workout has 3 steps, 4 declared at line 2, in block 1 (workout)");
+    CHECK(error_in(replaced(repeats_il, "num_valid_steps\n3\n", "")) ==
+          "Workout has 3 steps, 1 declared at line 2, in block 1 (workout)");
+
+    const auto forward = replaced(repeats_il, "duration_step\n0\n",
+                                  "duration_step\n2\n");
+    CHECK_NOTHROW(fit_of(forward));
+    CHECK(error_in(forward) == "Repeat from step 2, not an earlier one"
+          " at line 34, in block 4 (workout_step)");
+    CHECK(error_in(replaced(repeats_il, "duration_step\n0\n",
+                            "duration_step\n7\n")) ==
+          "Repeat from step 7, not an earlier one"
+          " at line 34, in block 4 (workout_step)");
+    CHECK(error_in(replaced(repeats_il, "duration_step\n0\n", "")) ==
+          "Repeat without duration_step at line 32, in block 4 (workout_step)");
+
+    // Parse errors as il2fit() gives them
+    const auto bad = replaced(repeats_il, "60", "sixty");
+    CHECK(error_in(bad) == error_of([&] { fit_of(bad); }));
+    CHECK(error_in("") == "No messages in the FIT file");
+}
+
+TEST_CASE("Check every document", "[check]")
+{
+    const auto error_in = [](const string& il) {
+        return error_of([&] { wrked::check(il); });
+    };
+    const auto lines = count(repeats_il.begin(), repeats_il.end(), '\n');
+
+    CHECK_NOTHROW(wrked::check(repeats_il + "EOF\n" + repeats_il));
+    CHECK_NOTHROW(wrked::check(repeats_il + "EOF\n" + repeats_il + "EOF\n"));
+    CHECK_NOTHROW(wrked::check(repeats_il + "EOF\n\n  \n"));
+
+    // Lines count from the start of the input
+    const auto count = replaced(repeats_il, "num_valid_steps\n3\n",
+                                "num_valid_steps\n4\n");
+    CHECK(error_in(repeats_il + "EOF\n" + count) ==
+          S("Document 1: Workout has 3 steps, 4 declared at line "
+            << lines + 3 << ", in block 1 (workout)"));
+    CHECK(error_in(count + "EOF\n" + repeats_il) ==
+          "Document 0: Workout has 3 steps, 4 declared"
+          " at line 2, in block 1 (workout)");
+    CHECK(error_in(repeats_il + "EOF\n" +
+                   replaced(repeats_il, "60", "sixty")) ==
+          S("Document 1: Bad syntax near \"sixty\" at line " << lines + 13
+            << ", in block 2 (workout_step)"));
+    CHECK(error_in(repeats_il + "EOF\nEOF\n" + repeats_il) ==
+          "Document 1: No messages in the FIT file");
+    CHECK(error_in("EOF\n" + repeats_il) ==
+          "Document 0: No messages in the FIT file");
+    CHECK(error_in("\n") == "No messages in the FIT file");
+
+    // And bytes in binary IL
+    const auto a = string(binary_magic) + bin_record(1, "");
+    const auto b = string(binary_magic) + bin_record(2, "") +
+        bin_record(3, bin_u32(19, 5000));
+    CHECK_NOTHROW(wrked::check(a + a + a));
+    CHECK(error_in(a + b) ==
+          S("Document 1: Value 5000 is out of range [0, 4095] at byte "
+            << a.size() + binary_magic.size() + 11
+            << ", in block 2 (workout_step)"));
+}
+
+//----------------------------------------------------------------------------
+// Cases for fit2il()
+
+TEST_CASE("FIT to IL and back", "[fit2il]")
+{
+    const auto il = replaced(repeats_il, "workout\nnum_valid_steps\n",
+                             "workout\nwkt_name\nOver under\nsport\n"
+                             "running\nnum_valid_steps\n") +
+        "begin\n"
+        "file_id\n"
+        "number\n"
+        "7\n"
+        "end\n"
+        "file_id\n"
+        "begin\n"
+        "file_creator\n"
+        "software_version\n"
+        "100\n"
+        "end\n"
+        "file_creator\n";
+    const auto fit = fit_of(il);
+
+    string back;
+    fit2il(fit, back);
+    CHECK(back.find("sport\nrunning\n") != string::npos);
+    CHECK(back.find("duration_type\nrepeat_until_steps_cmplt\n") !=
+          string::npos);
+    CHECK(fit_of(back) == fit);
+    CHECK(wrked::decode(fit) == back);
+}
+
+TEST_CASE("Chained FIT to IL documents", "[fit2il]")
+{
+    const auto fit = fit_of(repeats_il);
+    string one, two;
+    fit2il(fit, one);
+    fit2il(fit + fit, two);
+    CHECK(two == one + "EOF\n" + one);
+    CHECK_THROWS_AS(fit2il(fit.substr(1), one), runtime_error);
+}
+
+TEST_CASE("No FIT to IL for unnamed enums", "[fit2il]")
+{
+    auto fit = fit_of(replaced(repeats_il, "workout\nnum_valid_steps\n",
+                               "workout\nsport\nrunning\nnum_valid_steps\n"));
+
+    // Find the workout's sport, set it to a value without a name and
+    // fix the CRC
+    size_t at = 0, offset = 0;
+    walk_fit(fit, 0, [&](const local_mesg& m, string_view data, size_t o) {
+        if (m.num != FIT_MESG_NUM_WORKOUT) {
+            return;
+        }
+        for (size_t i = 0, pos = 0; i < m.fields.size(); i += 3) {
+            if (octet(m.fields[i]) == workout::sport.num) {
+                at = size_t(data.data() - fit.data()) + pos;
+                offset = o;
+            }
+            pos += octet(m.fields[i + 1]);
+        }
+    });
+    REQUIRE(at != 0);
+    REQUIRE(fit[at] == char(FIT_SPORT_RUNNING));
+    fit[at] = char(250);
+    const auto body = fit.size() - 2;
+    const auto crc = crc16(0, string_view(fit).substr(0, body));
+    fit[body] = char(crc & 0xFF);
+    fit[body + 1] = char(crc >> 8);
+    CHECK_NOTHROW(verify(fit));
+
+    string il;
+    CHECK(error_of([&] { fit2il(fit, il); }) ==
+          S("Offset " << offset << ": workout sport 250 has no IL name"));
+}
+
+//----------------------------------------------------------------------------
+// Cases for the library API
+
+TEST_CASE("Convert through the library", "[api]")
+{
+    const string il =
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n";
+    reader input(il);
+    encoder expected;
+    il2fit(input, expected);
+
+    wrked::converter conv;
+    CHECK(conv.convert(il) == expected.data());
+    CHECK(conv.convert(il) == expected.data());
+    CHECK(wrked::convert(il) == expected.data());
+    CHECK_THROWS_AS(conv.convert("begin\nnonsense\n"), runtime_error);
+    CHECK(conv.convert(il) == expected.data());
+}
+
+TEST_CASE("No allocations once warmed up", "[api]")
+{
+    const string il =
+        "begin\n"
+        "file_id\n"
+        "number\n"
+        "7\n"
+        "end\n"
+        "file_id\n"
+        "begin\n"
+        "workout\n"
+        "wkt_name\n"
+        "Over-under\n"
+        "sport\n"
+        "cycling\n"
+        "end\n"
+        "workout\n"
+        "begin\n"
+        "workout_step\n"
+        "wkt_step_name\n"
+        "Warm up\n"
+        "duration_time\n"
+        "600.5\n"
+        "target_hr_zone\n"
+        "2\n"
+        "intensity\n"
+        "warmup\n"
+        "end\n"
+        "workout_step\n";
+    wrked::converter conv;
+    const string expected(conv.convert(il));
+    count_allocations(true);
+    const auto before = allocations();
+    const auto fit = conv.convert(il);
+    const auto after = allocations();
+    CHECK(after == before);
+    CHECK(fit == expected);
+}
+
+TEST_CASE("Convert a batch through the library", "[api]")
+{
+    const string il =
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n"
+        "EOF\n"
+        "begin\n"
+        "nonsense\n"
+        "EOF\n"
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n";
+    const auto results = wrked::convert_batch(il, 2);
+    REQUIRE(results.size() == 3);
+    CHECK(results[0].error.empty());
+    CHECK_FALSE(results[0].fit.empty());
+    CHECK_FALSE(results[1].error.empty());
+    CHECK(results[1].fit.empty());
+    CHECK(results[2].fit == results[0].fit);
+}
+
+//----------------------------------------------------------------------------
+// Cases for document()
+
+TEST_CASE("No documents in empty input", "[document]")
+{
+    reader input(" \n\n");
+    CHECK(document(input) == none);
+}
+
+TEST_CASE("Single document without EOF", "[document]")
+{
+    reader input("begin\nfile_id\n");
+    CHECK(document(input) == some(string_view("begin\nfile_id\n")));
+    CHECK(document(input) == none);
+}
+
+TEST_CASE("Documents separated by EOF", "[document]")
+{
+    reader input(
+        "begin\n"
+        "file_id\n"
+        "EOF\n"
+        "\n"
+        "EOF\n"
+        "begin\n"
+        "workout\n"
+        " EOF \n"
+        "\n"
+        );
+    CHECK(document(input) == some(string_view("begin\nfile_id\n")));
+    CHECK(document(input) == some(string_view("\n")));
+    CHECK(document(input) == some(string_view("begin\nworkout\n")));
+    CHECK(document(input) == none);
+}
+
+TEST_CASE("Convert each document", "[document][il2fit]")
+{
+    reader input(
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n"
+        "EOF\n"
+        "begin\n"
+        "nonsense\n"
+        "EOF\n"
+        "begin\n"
+        "workout_step\n"
+        "end\n"
+        "workout_step\n"
+        );
+    size_t ok = 0, failed = 0;
+    while (const auto doc = document(input)) {
+        reader il(doc.value());
+        encoder output;
+        try {
+            il2fit(il, output);
+            ++ok;
+        } catch (const runtime_error&) {
+            ++failed;
+        }
+    }
+    CHECK(ok == 2);
+    CHECK(failed == 1);
 }
 
-TEST_CASE("Trim left and right", "[trim]")
+TEST_CASE("Binary documents", "[binary][document]")
 {
-    CHECK(trim(" \tabc\t ") == "abc");
+    const auto a = string(binary_magic) + bin_record(1, "");
+    const auto b = string(binary_magic) + bin_record(2, bin_str(3, "W"));
+    const auto il = a + b;
+    reader input(il);
+    CHECK(document(input) == some(string_view(a)));
+    CHECK(document(input) == some(string_view(b)));
+    CHECK(document(input) == none);
 }
 
 //----------------------------------------------------------------------------
-// Cases for line()
+// Cases for parallel()
 
-TEST_CASE("EOF on empty input", "[line]")
+TEST_CASE("Run and commit in order", "[parallel]")
 {
-    istringstream input;
-    CHECK(line(input) == none);
+    for (size_t jobs = 1; jobs <= 8; ++jobs) {
+        const size_t n = 100;
+        vector<size_t> ran(n, 0);
+        vector<size_t> committed;
+        parallel(jobs, n,
+                 [&](size_t i) { ++ran[i]; },
+                 [&](size_t i) { committed.push_back(i); });
+        CHECK(std::count(ran.begin(), ran.end(), 1u) == n);
+        REQUIRE(committed.size() == n);
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(committed[i] == i);
+        }
+    }
 }
 
-TEST_CASE("Empty line", "[line]")
+TEST_CASE("Convert documents in parallel", "[parallel][il2fit]")
 {
-    istringstream input("\n");
-    CHECK(line(input) == some(string("")));
-    CHECK(line(input) == none);
+    const string doc =
+        "begin\n"
+        "workout\n"
+        "end\n"
+        "workout\n";
+    const size_t n = 32;
+    vector<string> fits(n);
+    parallel(4, n,
+             [&](size_t i) {
+                 reader input(doc);
+                 encoder output;
+                 il2fit(input, output);
+                 fits[i] = string(output.data());
+             },
+             [&](size_t) {});
+    for (const auto& fit : fits) {
+        CHECK(fit == fits[0]);
+    }
 }
 
-TEST_CASE("Incomplete line", "[line]")
+TEST_CASE("Parse a large document in chunks", "[parallel][il2fit]")
 {
-    istringstream input("abc");
-    CHECK(line(input) == some(string("abc")));
-    CHECK(line(input) == none);
+    // Some step names look like the start of a message, where chunks may
+    // be cut
+    string il = "begin\nworkout\nwkt_name\nLong\nend\nworkout\n";
+    for (int i = 0; i < 4000; ++i) {
+        il += "begin\nworkout_step\nmessage_index\n" + std::to_string(i) +
+            "\nwkt_step_name\n" + (i % 3 ? "Step" : "begin") +
+            "\nduration_time\n60\nend\nworkout_step\n";
+    }
+    reader input(il);
+    encoder expected;
+    il2fit(input, expected);
+
+    for (const size_t chunk : { 64, 1000, 1 << 12 }) {
+        for (const size_t jobs : { 2, 8 }) {
+            reader input(il);
+            encoder output;
+            il2fit_parallel(input, output, jobs, nullptr, chunk);
+            CHECK(output.data() == expected.data());
+        }
+    }
+
+    // Stops at EOF, as il2fit() does
+    const auto with_eof = il + "EOF\nbegin\nworkout\nend\nworkout\n";
+    reader eof(with_eof);
+    encoder output;
+    il2fit_parallel(eof, output, 4, nullptr, 1000);
+    CHECK(output.data() == expected.data());
+
+    // The same counts as without chunks
+    reader plain(il), chunked(il);
+    doc_stats plain_stats, chunked_stats;
+    il2fit(plain, output, nullptr, &plain_stats);
+    il2fit_parallel(chunked, output, 4, &chunked_stats, 1000);
+    CHECK(chunked_stats.messages[2] == 1);
+    CHECK(chunked_stats.messages[3] == 4000);
+    CHECK(chunked_stats.tokens == plain_stats.tokens);
+    CHECK(chunked_stats.bytes_in == plain_stats.bytes_in);
+
+    // The same error as without chunks
+    const auto step = il.find("message_index\n2500\n");
+    const auto bad = il.substr(0, step) +
+        replaced(il.substr(step), "duration_time\n60\n", "duration_time\nx\n");
+    reader broken(bad), serial(bad);
+    const auto expected_error =
+        "Bad syntax near \"x\" at line 25014, in block 2502 (workout_step)";
+    CHECK(error_of([&] { il2fit_parallel(broken, output, 4, nullptr, 1000); }) ==
+          expected_error);
+    CHECK(error_of([&] { il2fit(serial, output); }) == expected_error);
 }
 
-TEST_CASE("Single complete line", "[line]")
+TEST_CASE("Parse a large binary document in chunks", "[parallel][binary]")
 {
-    istringstream input("abc\n");
-    CHECK(line(input) == some(string("abc")));
-    CHECK(line(input) == none);
+    string il = string(binary_magic) + bin_record(2, bin_str(3, "Long"));
+    for (uint32_t i = 0; i < 4000; ++i) {
+        il += bin_record(3, bin_u32(19, i) + bin_f32(15, 60));
+    }
+    reader input(il);
+    encoder expected;
+    il2fit(input, expected);
+
+    reader chunked(il);
+    encoder output;
+    il2fit_parallel(chunked, output, 4, nullptr, 256);
+    CHECK(output.data() == expected.data());
+
+    // Field 200 of the step with index 1000
+    const auto bad = replaced(il, bin_u32(19, 1000), bin_u32(200, 1000));
+    reader broken(bad), serial(bad);
+    const auto e = error_of([&] {
+            il2fit_parallel(broken, output, 4, nullptr, 256);
+        });
+    CHECK(e == error_of([&] { il2fit(serial, output); }));
+    CHECK(e.find("Bad field 200 at byte ") == 0);
+    CHECK(e.find(", in block 1002 (workout_step)") != string::npos);
 }
 
-TEST_CASE("Multiple lines", "[line]")
+//----------------------------------------------------------------------------
+// Cases for the FIT cache
+
+TEST_CASE("Cache key ignores whitespace around lines", "[cache]")
 {
-    istringstream input("abc\ndef\n");
-    CHECK(line(input) == some(string("abc")));
-    CHECK(line(input) == some(string("def")));
-    CHECK(line(input) == none);
+    const auto key = encoder::cache_key("begin\nworkout\nend\nworkout\n");
+    CHECK(key.size() == 32);
+    CHECK(encoder::cache_key(" begin \r\n\tworkout\nend\nworkout") == key);
+    CHECK(encoder::cache_key("begin\nworkout\nend\nworkout\n\n") != key);
+    CHECK(encoder::cache_key("begin\nfile_id\nend\nfile_id\n") != key);
+
+    // Only the same IL through the same encoder is a hit
+    CHECK(fit_cache::key("begin\nworkout\nend\nworkout\n") != key);
+    CHECK(fit_cache::key(S("il2fit-cache-" << encoder::format << '-'
+                           << FIT_PROFILE_VERSION
+                           << "\nbegin\nworkout\nend\nworkout\n")) == key);
 }
 
+#elif defined(_WITH_BENCHMARKS)
+
 //----------------------------------------------------------------------------
-// Cases for value()
+// Benchmarks
 
-TEST_CASE("Error on empty input", "[value]")
+using std::setprecision;
+
+namespace {
+
+//----------------------------------------------------------------------------
+// Synthetic IL, shaped like wrk2il output
+
+void
+single_step(ostream& il, size_t i)
 {
-    istringstream input;
-    CHECK_THROWS_AS(value<string>(input), runtime_error);
+    il << "begin\nworkout_step\n"
+       << "message_index\n" << i << "\n"
+       << "wkt_step_name\nStep " << i << "\n";
+    switch (i % 4) {
+    case 0:
+        il << "duration_type\ntime\n"
+           << "duration_time\n" << 60 + i % 600 << "\n"
+           << "target_type\nheart_rate\n"
+           << "target_hr_zone\n0\n"
+           << "custom_target_heart_rate_low\n" << 220 + i % 20 << "\n"
+           << "custom_target_heart_rate_high\n" << 250 + i % 20 << "\n";
+        break;
+    case 1:
+        il << "duration_type\ndistance\n"
+           << "duration_distance\n" << 400 + i % 1000 << "\n"
+           << "target_type\nspeed\n"
+           << "target_value\n0\n"
+           << "custom_target_speed_low\n" << 3 + i % 3 * 0.25 << "\n"
+           << "custom_target_speed_high\n" << 4 + i % 3 * 0.25 << "\n";
+        break;
+    case 2:
+        il << "duration_type\ntime\n"
+           << "duration_time\n" << 30 + i % 90 << "\n"
+           << "target_type\npower\n"
+           << "target_power_zone\n" << 1 + i % 7 << "\n"
+           << "custom_target_power_low\n0\n"
+           << "custom_target_power_high\n0\n";
+        break;
+    default:
+        il << "duration_type\nopen\n"
+           << "target_type\nopen\n";
+        break;
+    }
+    il << "intensity\n" << (i % 2 ? "active" : "rest") << "\n"
+       << "end\nworkout_step\n";
 }
 
-TEST_CASE("Parse string value", "[value]")
+void
+repeat_step(ostream& il, size_t i, size_t first)
 {
-    istringstream input("abc\n");
-    CHECK(value<string>(input) == "abc");
+    il << "begin\nworkout_step\n"
+       << "message_index\n" << i << "\n"
+       << "duration_type\nrepeat_until_steps_cmplt\n"
+       << "repeat_steps\n3\n"
+       << "duration_step\n" << first << "\n"
+       << "end\nworkout_step\n";
 }
 
-TEST_CASE("Parse string value with padding", "[value]")
+// A step before and after each level of repeats, depth levels deep.
+// Returns the next step index.
+size_t
+nested_steps(ostream& il, size_t i, size_t depth)
 {
-    istringstream input(" abc\t\t\n");
-    CHECK(value<string>(input) == "abc");
+    const auto first = i;
+    single_step(il, i++);
+    if (depth > 1) {
+        i = nested_steps(il, i, depth - 1);
+    }
+    single_step(il, i++);
+    repeat_step(il, i, first);
+    return i + 1;
 }
 
-TEST_CASE("Parse int value", "[value]")
+void
+header(ostream& il, size_t steps)
 {
-    istringstream input("123\n");
-    CHECK(value<int>(input) == 123);
+    il << "begin\nfile_id\n"
+       << "time_created\n1457736704\n"
+       << "end\nfile_id\n"
+       << "begin\nworkout\n"
+       << "wkt_name\nBenchmark\n"
+       << "sport\ncycling\n"
+       << "capabilities\n32\n"
+       << "num_valid_steps\n" << steps << "\n"
+       << "end\nworkout\n";
 }
 
-TEST_CASE("Parse double value", "[value]")
+string
+flat_workout(size_t steps)
 {
-    istringstream input("45.6\n");
-    CHECK(value<double>(input) == Approx(45.6));
+    ostringstream il;
+    header(il, steps);
+    for (size_t i = 0; i < steps; ++i) {
+        single_step(il, i);
+    }
+    return il.str();
 }
 
-//----------------------------------------------------------------------------
-// Cases for value() with range
-
-TEST_CASE("Parse value with range", "[value]")
+string
+nested_workout(size_t depth)
 {
-    istringstream input("55\n");
-    CHECK(value<int>(input, 0, 100) == 55);
+    ostringstream steps;
+    const auto n = nested_steps(steps, 0, depth);
+    ostringstream il;
+    header(il, n);
+    il << steps.str();
+    return il.str();
 }
 
-TEST_CASE("Parse value out of range", "[value]")
+//----------------------------------------------------------------------------
+// Phases of il2fit()
+
+// Lines only, the floor for any text IL parser
+size_t
+tokenize(string_view il)
 {
-    istringstream input("55\n");
-    CHECK_THROWS_AS(value<int>(input, 0, 10), runtime_error);
+    reader input(il);
+    size_t ans = 0;
+    while (const auto lopt = line(input)) {
+        ans += trim(lopt.value()).size();
+    }
+    return ans;
 }
 
-TEST_CASE("Parse value, range endpoints out of order", "[value]")
+// Parse into messages, as il2fit() does before encoding
+void
+parse(string_view il, vector<any_mesg>& messages)
 {
-    istringstream input("55\n");
-    CHECK(value<int>(input, 100, 0) == 55);
+    static constexpr auto& names = message_names;
+
+    messages.clear();
+    reader input(il);
+    while (const auto mopt = message(input)) {
+        switch (mopt.value()) {
+        case names["file_creator"]:
+            messages.push_back(value<file_creator_mesg>(input));
+            break;
+        case names["file_id"]:
+            messages.push_back(value<file_id_mesg>(input));
+            break;
+        case names["workout"]:
+            messages.push_back(value<workout_mesg>(input));
+            break;
+        case names["workout_step"]:
+            messages.push_back(value<workout_step_mesg>(input));
+            break;
+        }
+    }
 }
 
-TEST_CASE("Parse value, range pair", "[value]")
+void
+encode(const vector<any_mesg>& messages, encoder& encode)
 {
-    istringstream input("55\n55\n");
-    CHECK(value<int>(input, 0, 100) ==
-          value<int>(input, make_pair(0, 100)));
+    encode.open();
+    for (const auto& m : messages) {
+        visit([&](const auto& m) { encode.write(m); }, m);
+    }
+    encode.close();
 }
 
-//----------------------------------------------------------------------------
-// Cases for value() for enumerations
-
-TEST_CASE("Parse enum value", "[value]")
+// The same message for the SDK
+template <FIT_UINT16 Num, const auto& Defs>
+fit::Mesg
+sdk_mesg(const mesg<Num, Defs>& m)
 {
-    istringstream input("xyz\n");
-    CHECK(value<int>(input, {
-                { "xyz", 10 },
-                { "abc", 12 }
-            }) == 10);
+    fit::Mesg ans(Num);
+    for (const auto& f : m) {
+        switch (f.type) {
+        case FIT_BASE_TYPE_ENUM:
+            ans.SetFieldENUMValue(f.num, static_cast<FIT_ENUM>(f.number));
+            break;
+        case FIT_BASE_TYPE_UINT8:
+            ans.SetFieldUINT8Value(f.num, static_cast<FIT_UINT8>(f.number));
+            break;
+        case FIT_BASE_TYPE_UINT16:
+            ans.SetFieldUINT16Value(f.num, static_cast<FIT_UINT16>(f.number));
+            break;
+        case FIT_BASE_TYPE_UINT32:
+            ans.SetFieldUINT32Value(f.num, f.number);
+            break;
+        case FIT_BASE_TYPE_UINT32Z:
+            ans.SetFieldUINT32ZValue(f.num, f.number);
+            break;
+        case FIT_BASE_TYPE_STRING:
+            ans.SetFieldSTRINGValue(f.num,
+                                    FIT_WSTRING(f.text.begin(), f.text.end()));
+            break;
+        }
+    }
+    return ans;
 }
 
-TEST_CASE("Parse enum value, invalid token", "[value]")
+string
+sdk_encode(const vector<fit::Mesg>& messages)
 {
-    istringstream input("xyz\n");
-    CHECK_THROWS_AS(value<int>(input, {
-                { "abc", 20 },
-                { "def", 30 }
-            }), runtime_error);
+    stringstream output(ios::in | ios::out | ios::binary);
+    fit::Encode encode(fit::ProtocolVersion::V10);
+    encode.Open(output);
+    for (const auto& m : messages) {
+        encode.Write(m);
+    }
+    if (!encode.Close()) {
+        error("FIT encoder failed");
+    }
+    return output.str();
 }
 
 //----------------------------------------------------------------------------
-// Cases for match()
+// Timing
 
-TEST_CASE("Empty match table", "[match]")
+// Best seconds per call of f, over runs of at least 0.2 s in total
+template <class F>
+double
+seconds(F&& f)
 {
-    istringstream input("xyz\n\nabc\n");
-    static const unordered_map<string, function<void()> > empty;
-    CHECK_THROWS_AS(match(input, empty), runtime_error);
-    CHECK_THROWS_AS(match(input, empty), runtime_error);
-    CHECK_THROWS_AS(match(input, empty), runtime_error);
+    using clock = chrono::steady_clock;
+    double best = 0;
+    size_t runs = 0;
+    for (const auto start = clock::now();
+         runs < 3 || clock::now() - start < chrono::milliseconds(200);
+         ++runs) {
+        const auto t0 = clock::now();
+        f();
+        const chrono::duration<double> t = clock::now() - t0;
+        if (runs == 0 || t.count() < best) {
+            best = t.count();
+        }
+    }
+    return best;
 }
 
-TEST_CASE("Match table", "[match]")
+void
+report(const string& phase, size_t steps, size_t bytes, double t)
 {
-    istringstream input("xyz\nabc\n");
-    bool ok = false;
-    match(input, { { "xyz", [&] { ok = true; } } });
-    CHECK(ok);
+    cout << "  " << setw(12) << phase
+         << setw(14) << static_cast<size_t>(steps / t) << " steps/s"
+         << setw(10) << std::fixed << setprecision(1) << bytes / t / 1e6 << " MB/s"
+         << endl;
 }
 
-//----------------------------------------------------------------------------
-// Cases for value<fit::FileCreatorMesg>
-
-TEST_CASE("Valid file_creator", "[file_creator][value]")
+void
+benchmark(const string& name, const string& il)
 {
-    istringstream input(
-        "hardware_version\n"
-        "150\n"
-        "software_version\n"
-        "330\n"
-        "end\n"
-        "file_creator\n"
-        );
-    CHECK_NOTHROW(value<fit::FileCreatorMesg>(input));
-}
+    vector<any_mesg> messages;
+    parse(il, messages);
+    const size_t steps = messages.size() - 2;
 
-//----------------------------------------------------------------------------
-// Cases for value<fit::FileIdMesg>
+    encoder native;
+    encode(messages, native);
+    const auto fit_size = native.data().size();
 
-TEST_CASE("Valid file_id", "[file_id][value]")
-{
-    istringstream input(
-        "time_created\n"
-        "1457736704\n"
-        "serial_number\n"
-        "2501\n"
-        "number\n"
-        "5\n"
-        "end\n"
-        "file_id\n"
-        );
-    CHECK_NOTHROW(value<fit::FileIdMesg>(input));
-}
+    vector<fit::Mesg> sdk;
+    for (const auto& m : messages) {
+        sdk.push_back(visit([](const auto& m) { return sdk_mesg(m); }, m));
+    }
+    if (sdk_encode(sdk) != native.data()) {
+        cerr << name << ": output differs from fit::Encode" << endl;
+    }
 
-//----------------------------------------------------------------------------
-// Cases for value<fit::WorkoutMesg>
+    cout << name << ": " << steps << " steps, "
+         << il.size() << " bytes IL, " << fit_size << " bytes FIT" << endl;
 
-TEST_CASE("Valid workout", "[value][workout]")
-{
-    istringstream input(
-        "wkt_name\n"
-        "Tempo\n"
-        "sport\n"
-        "fishing\n"
-        "num_valid_steps\n"
-        "15\n"
-        "capabilities\n"
-        "31\n"
-        "end\n"
-        "workout\n"
-        );
-    CHECK_NOTHROW(value<fit::WorkoutMesg>(input));
-}
+    // MB/s of IL for the parsing phases, of FIT for the encoders
+    size_t sink = 0;
+    report("tokenize", steps, il.size(),
+           seconds([&] { sink += tokenize(il); }));
+    report("parse", steps, il.size(),
+           seconds([&] { parse(il, messages); }));
+    report("encode", steps, fit_size,
+           seconds([&] { encode(messages, native); }));
+    report("fit::Encode", steps, fit_size,
+           seconds([&] { sink += sdk_encode(sdk).size(); }));
+    report("il2fit", steps, il.size(),
+           seconds([&] {
+                   reader input(il);
+                   il2fit(input, native);
+               }));
+    report("check", steps, il.size(),
+           seconds([&] {
+                   reader input(il);
+                   check(input);
+               }));
+    const size_t threads = max(1u, thread::hardware_concurrency());
+    if (threads > 1 && il.size() >= 2 << 16) {
+        report(S("chunked x" << threads), steps, il.size(),
+               seconds([&] {
+                       reader input(il);
+                       il2fit_parallel(input, native, threads);
+                   }));
+    }
+    report("verify", steps, fit_size,
+           seconds([&] { verify(native.data()); }));
+    string il_again;
+    report("fit2il", steps, fit_size,
+           seconds([&] { fit2il(native.data(), il_again); }));
 
-//----------------------------------------------------------------------------
-// Cases for value<fit::WorkoutStepMesg>
+    if (sink == 0) {
+        cout << endl;
+    }
+}
 
-TEST_CASE("Valid workout_step", "[value][workout_step]")
+// Numeric tokens as IL has them, by each way of reading them
+void
+number_benchmark()
 {
-    istringstream input(
-        "message_index\n"
-        "3\n"
-        "wkt_step_name\n"
-        "Intro\n"
-        "intensity\n"
-        "warmup\n"
-        "duration_time\n"
-        "31.5\n"
-        "target_value\n"
-        "0\n"
-        "custom_target_heart_rate_low\n"
-        "50\n"
-        "custom_target_heart_rate_high\n"
-        "270\n"
-        "end\n"
-        "workout_step\n"
-        );
-    CHECK_NOTHROW(value<fit::WorkoutStepMesg>(input));
-}
+    // Lines of one buffer, as the reader has them
+    string il;
+    for (size_t i = 0; i < 4096; ++i) {
+        il += S(i << '\n' << i * 7919 % 100000 << '\n'
+                << i % 600 << "." << i % 10 << '\n');
+    }
+    vector<string_view> tokens;
+    size_t bytes = 0;
+    for (size_t pos = 0; pos < il.size(); ) {
+        const auto eol = il.find('\n', pos);
+        tokens.push_back(string_view(il).substr(pos, eol - pos));
+        bytes += eol - pos;
+        pos = eol + 1;
+    }
+    const auto avail = [&](string_view t) {
+        return size_t(il.data() + il.size() - t.data());
+    };
 
-//----------------------------------------------------------------------------
-// Cases for il2fit
+    double sink = 0;
+    const auto run = [&](const string& name, auto read) {
+        const auto t = seconds([&] {
+                for (const auto& t : tokens) {
+                    sink += read(t);
+                }
+            });
+        cout << "  " << setw(12) << name
+             << setw(14) << static_cast<size_t>(tokens.size() / t) << " tokens/s"
+             << setw(9) << std::fixed << setprecision(1) << bytes / t / 1e6 << " MB/s"
+             << endl;
+    };
 
-TEST_CASE("Fail on empty IL input", "[il2fit]")
-{
-    istringstream input;
-    stringstream output;
-    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+    cout << "numbers, sse4.1: " << (have_sse41() ? "yes" : "no") << endl;
+    // As parse() was before the fast paths
+    run("from_chars", [](string_view t) {
+            const auto read = [t](auto ans) {
+                const auto r = from_chars(t.data(), t.data() + t.size(), ans);
+                if (r.ec != errc() || r.ptr != t.data() + t.size()) {
+                    error("Bad syntax near \"" + string(t) + "\"");
+                }
+                return double(ans);
+            };
+            return t.find('.') != string_view::npos ?
+                read(FIT_FLOAT32()) : read(FIT_UINT32());
+        });
+    run("scalar", [](string_view t) {
+            return double(decimal_scalar(t).value_or(decimal{ 0, 0 }).digits);
+        });
+#ifdef IL2FIT_WITH_SSE41
+    if (have_sse41()) {
+        run("sse4.1", [&](string_view t) {
+                return double(decimal_sse41(t, avail(t))
+                              .value_or(decimal{ 0, 0 }).digits);
+            });
+    }
+#endif
+    run("parse", [&](string_view t) {
+            return t.find('.') != string_view::npos ?
+                double(parse<FIT_FLOAT32>(t, avail(t))) :
+                double(parse<FIT_UINT32>(t, avail(t)));
+        });
+
+    if (sink == 0) {
+        cout << endl;
+    }
 }
 
-TEST_CASE("Invalid IL input", "[il2fit]")
+// Documents of a batch split and converted on all CPUs
+void
+batch_benchmark(const string& il, size_t steps, size_t copies)
 {
-    istringstream input(
-        "begin\n"
-        "nonsense\n"
-        "end\n"
-        "nonsense\n"
-        );
-    stringstream output;
-    CHECK_THROWS_AS(il2fit(input, output), runtime_error);
+    string batch;
+    for (size_t i = 0; i < copies; ++i) {
+        batch += il + "EOF\n";
+    }
+    const auto threads = max(1u, thread::hardware_concurrency());
+
+    vector<string_view> docs;
+    vector<encoder> outputs(copies);
+    const auto t = seconds([&] {
+            docs.clear();
+            reader input(batch);
+            while (const auto doc = document(input)) {
+                docs.push_back(doc.value());
+            }
+            parallel(threads, docs.size(),
+                     [&](size_t i) {
+                         reader input(docs[i]);
+                         il2fit(input, outputs[i]);
+                     },
+                     [](size_t) {});
+        });
+
+    string chained;
+    for (const auto& o : outputs) {
+        chained += o.data();
+    }
+
+    cout << "batch of " << copies << " on " << threads << " threads:" << endl;
+    report("il2fit", copies * steps, batch.size(), t);
+    report("verify", copies * steps, chained.size(),
+           seconds([&] { verify(chained); }));
 }
 
-TEST_CASE("Valid IL input", "[il2fit]")
+} // namespace
+
+int main()
 {
-    istringstream input(
-        "begin\n"
-        "file_id\n"
-        "end\n"
-        "file_id\n"
-        "begin\n"
-        "file_creator\n"
-        "end\n"
-        "file_creator\n"
-        "begin\n"
-        "workout\n"
-        "end\n"
-        "workout\n"
-        "begin\n"
-        "workout_step\n"
-        "end\n"
-        "workout_step\n"
-        );
-    stringstream output;
-    CHECK_NOTHROW(il2fit(input, output));
-    CHECK_FALSE(output.str().empty());
+    crc_benchmark();
+    cout << endl;
+    number_benchmark();
+    cout << endl;
+
+    // Message indices are 12 bits, 4096 steps is the most a workout has
+    for (const size_t n : { 10, 1000, 4096 }) {
+        benchmark(S("flat " << n), flat_workout(n));
+    }
+    for (const size_t depth : { 10, 100, 1000 }) {
+        benchmark(S("nested " << depth), nested_workout(depth));
+    }
+    batch_benchmark(flat_workout(1000), 1000, 64);
+
+    return 0;
 }
 
-#endif  // _WITH_TESTS
+#endif  // _WITH_BENCHMARKS
@@ -0,0 +1,71 @@
+#ifndef IL2FIT_HPP
+#define IL2FIT_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// In-process IL to FIT conversion, the same as the il2fit tool does for
+// one document. Errors are thrown as std::runtime_error with the
+// message il2fit would print.
+namespace wrked {
+
+// Keeps the output buffer and parser state between conversions, so that
+// converting many workouts doesn't allocate once warmed up. Not thread
+// safe, use one per thread.
+class converter
+{
+public:
+    converter();
+    ~converter();
+
+    converter(const converter&) = delete;
+    converter& operator=(const converter&) = delete;
+
+    // FIT file for one text or binary IL document. The result is valid
+    // until the next call or the converter is gone.
+    std::string_view
+    convert(std::string_view il);
+
+private:
+    struct state;
+    std::unique_ptr<state> state_;
+};
+
+// One-off conversion
+std::string
+convert(std::string_view il);
+
+struct result
+{
+    std::string fit;
+    std::string error;          // Empty on success
+};
+
+// Each document of a batch, as il2fit --batch reads it, converted on up
+// to jobs threads. Failed documents have an error and no FIT. Threads
+// left over parse large documents in chunks.
+std::vector<result>
+convert_batch(std::string_view il, std::size_t jobs = 1);
+
+// Check IL, every document of it, as il2fit --check does, without
+// converting it.
+// Throws std::runtime_error describing the first problem.
+void
+check(std::string_view il);
+
+// Check a FIT file, or chained FIT files, as il2fit --verify does.
+// Throws std::runtime_error describing the first problem.
+void
+verify(std::string_view fit);
+
+// Text IL that converts back to the FIT file, as il2fit --decode writes
+// it. Throws std::runtime_error for broken files.
+std::string
+decode(std::string_view fit);
+
+} // namespace wrked
+
+#endif  // IL2FIT_HPP
@@ -0,0 +1,239 @@
+#ifndef IL2FIT_PROFILE_HPP
+#define IL2FIT_PROFILE_HPP
+
+#include <cstddef>
+
+#include "table.hpp"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-qualifiers"
+
+// Brings in the SDK's profile types and constants
+#include <fit_date_time.hpp>
+
+#pragma GCC diagnostic pop
+
+// The part of the FIT profile that il2fit reads and writes: the fields
+// of its messages and the names of their enum values
+
+// Field of a message: its slot, the position in the message's list of
+// fields, and its number and base type from the FIT profile
+struct field_def
+{
+    FIT_UINT8 slot;
+    FIT_UINT8 num;
+    FIT_UINT8 type;
+};
+
+namespace file_creator {
+constexpr field_def software_version = { 0, 0, FIT_BASE_TYPE_UINT16 };
+constexpr field_def hardware_version = { 1, 1, FIT_BASE_TYPE_UINT8 };
+
+constexpr field_def defs[] = {
+    software_version,
+    hardware_version
+};
+} // namespace file_creator
+
+namespace file_id {
+constexpr field_def type = { 0, 0, FIT_BASE_TYPE_ENUM };
+constexpr field_def manufacturer = { 1, 1, FIT_BASE_TYPE_UINT16 };
+constexpr field_def product = { 2, 2, FIT_BASE_TYPE_UINT16 };
+constexpr field_def serial_number = { 3, 3, FIT_BASE_TYPE_UINT32Z };
+constexpr field_def time_created = { 4, 4, FIT_BASE_TYPE_UINT32 };
+constexpr field_def number = { 5, 5, FIT_BASE_TYPE_UINT16 };
+
+constexpr field_def defs[] = {
+    type,
+    manufacturer,
+    product,
+    serial_number,
+    time_created,
+    number
+};
+} // namespace file_id
+
+namespace workout {
+constexpr field_def sport = { 0, 4, FIT_BASE_TYPE_ENUM };
+constexpr field_def capabilities = { 1, 5, FIT_BASE_TYPE_UINT32Z };
+constexpr field_def num_valid_steps = { 2, 6, FIT_BASE_TYPE_UINT16 };
+constexpr field_def wkt_name = { 3, 8, FIT_BASE_TYPE_STRING };
+
+constexpr field_def defs[] = {
+    sport,
+    capabilities,
+    num_valid_steps,
+    wkt_name
+};
+
+constexpr auto sports = make_table<FIT_SPORT>({
+    { "generic"                 , FIT_SPORT_GENERIC                 },
+    { "running"                 , FIT_SPORT_RUNNING                 },
+    { "cycling"                 , FIT_SPORT_CYCLING                 },
+    { "transition"              , FIT_SPORT_TRANSITION              },
+    { "fitness_equipment"       , FIT_SPORT_FITNESS_EQUIPMENT       },
+    { "swimming"                , FIT_SPORT_SWIMMING                },
+    { "basketball"              , FIT_SPORT_BASKETBALL              },
+    { "soccer"                  , FIT_SPORT_SOCCER                  },
+    { "tennis"                  , FIT_SPORT_TENNIS                  },
+    { "american_football"       , FIT_SPORT_AMERICAN_FOOTBALL       },
+    { "training"                , FIT_SPORT_TRAINING                },
+    { "walking"                 , FIT_SPORT_WALKING                 },
+    { "cross_country_skiing"    , FIT_SPORT_CROSS_COUNTRY_SKIING    },
+    { "alpine_skiing"           , FIT_SPORT_ALPINE_SKIING           },
+    { "snowboarding"            , FIT_SPORT_SNOWBOARDING            },
+    { "rowing"                  , FIT_SPORT_ROWING                  },
+    { "mountaineering"          , FIT_SPORT_MOUNTAINEERING          },
+    { "hiking"                  , FIT_SPORT_HIKING                  },
+    { "multisport"              , FIT_SPORT_MULTISPORT              },
+    { "paddling"                , FIT_SPORT_PADDLING                },
+    { "flying"                  , FIT_SPORT_FLYING                  },
+    { "e_biking"                , FIT_SPORT_E_BIKING                },
+    { "motorcycling"            , FIT_SPORT_MOTORCYCLING            },
+    { "boating"                 , FIT_SPORT_BOATING                 },
+    { "driving"                 , FIT_SPORT_DRIVING                 },
+    { "golf"                    , FIT_SPORT_GOLF                    },
+    { "hang_gliding"            , FIT_SPORT_HANG_GLIDING            },
+    { "horseback_riding"        , FIT_SPORT_HORSEBACK_RIDING        },
+    { "hunting"                 , FIT_SPORT_HUNTING                 },
+    { "fishing"                 , FIT_SPORT_FISHING                 },
+    { "inline_skating"          , FIT_SPORT_INLINE_SKATING          },
+    { "rock_climbing"           , FIT_SPORT_ROCK_CLIMBING           },
+    { "sailing"                 , FIT_SPORT_SAILING                 },
+    { "ice_skating"             , FIT_SPORT_ICE_SKATING             },
+    { "sky_diving"              , FIT_SPORT_SKY_DIVING              },
+    { "snowshoeing"             , FIT_SPORT_SNOWSHOEING             },
+    { "snowmobiling"            , FIT_SPORT_SNOWMOBILING            },
+    { "stand_up_paddleboarding" , FIT_SPORT_STAND_UP_PADDLEBOARDING },
+    { "surfing"                 , FIT_SPORT_SURFING                 },
+    { "wakeboarding"            , FIT_SPORT_WAKEBOARDING            },
+    { "water_skiing"            , FIT_SPORT_WATER_SKIING            },
+    { "kayaking"                , FIT_SPORT_KAYAKING                },
+    { "rafting"                 , FIT_SPORT_RAFTING                 },
+    { "windsurfing"             , FIT_SPORT_WINDSURFING             },
+    { "kitesurfing"             , FIT_SPORT_KITESURFING             }
+});
+} // namespace workout
+
+namespace workout_step {
+constexpr field_def message_index = { 0, 254, FIT_BASE_TYPE_UINT16 };
+constexpr field_def wkt_step_name = { 1, 0, FIT_BASE_TYPE_STRING };
+constexpr field_def duration_type = { 2, 1, FIT_BASE_TYPE_ENUM };
+// duration_time (s * 1000), duration_distance (m * 100), duration_hr,
+// duration_calories, duration_step, duration_power
+constexpr field_def duration_value = { 3, 2, FIT_BASE_TYPE_UINT32 };
+constexpr field_def target_type = { 4, 3, FIT_BASE_TYPE_ENUM };
+// target_hr_zone, target_power_zone, repeat_steps, repeat_time
+// (s * 1000), repeat_distance (m * 100), repeat_calories, repeat_hr,
+// repeat_power
+constexpr field_def target_value = { 5, 4, FIT_BASE_TYPE_UINT32 };
+// custom_target_speed_* (m/s * 1000), custom_target_heart_rate_*,
+// custom_target_cadence_*, custom_target_power_*
+constexpr field_def custom_target_value_low = { 6, 5, FIT_BASE_TYPE_UINT32 };
+constexpr field_def custom_target_value_high = { 7, 6, FIT_BASE_TYPE_UINT32 };
+constexpr field_def intensity = { 8, 7, FIT_BASE_TYPE_ENUM };
+
+constexpr field_def defs[] = {
+    message_index,
+    wkt_step_name,
+    duration_type,
+    duration_value,
+    target_type,
+    target_value,
+    custom_target_value_low,
+    custom_target_value_high,
+    intensity
+};
+
+constexpr auto intensities = make_table<FIT_INTENSITY>({
+    { "active"   , FIT_INTENSITY_ACTIVE   },
+    { "rest"     , FIT_INTENSITY_REST     },
+    { "warmup"   , FIT_INTENSITY_WARMUP   },
+    { "cooldown" , FIT_INTENSITY_COOLDOWN }
+});
+
+constexpr auto duration_types = make_table<FIT_WKT_STEP_DURATION>({
+    { "time"                            , FIT_WKT_STEP_DURATION_TIME                            },
+    { "distance"                        , FIT_WKT_STEP_DURATION_DISTANCE                        },
+    { "hr_less_than"                    , FIT_WKT_STEP_DURATION_HR_LESS_THAN                    },
+    { "hr_greater_than"                 , FIT_WKT_STEP_DURATION_HR_GREATER_THAN                 },
+    { "colories"                        , FIT_WKT_STEP_DURATION_CALORIES                        },
+    { "open"                            , FIT_WKT_STEP_DURATION_OPEN                            },
+    { "repeat_until_steps_cmplt"        , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_STEPS_CMPLT        },
+    { "repeat_until_time"               , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_TIME               },
+    { "repeat_until_distance"           , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_DISTANCE           },
+    { "repeat_until_calories"           , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_CALORIES           },
+    { "repeat_until_hr_less_than"       , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_LESS_THAN       },
+    { "repeat_until_hr_greater_than"    , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_GREATER_THAN    },
+    { "repeat_until_power_less_than"    , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_LESS_THAN    },
+    { "repeat_until_power_greater_than" , FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_GREATER_THAN },
+    { "power_less_than"                 , FIT_WKT_STEP_DURATION_POWER_LESS_THAN                 },
+    { "power_greater_than"              , FIT_WKT_STEP_DURATION_POWER_GREATER_THAN              },
+    { "repetition_time"                 , FIT_WKT_STEP_DURATION_REPETITION_TIME                 }
+});
+
+constexpr auto target_types = make_table<FIT_WKT_STEP_TARGET>({
+    { "speed"      , FIT_WKT_STEP_TARGET_SPEED      },
+    { "heart_rate" , FIT_WKT_STEP_TARGET_HEART_RATE },
+    { "open"       , FIT_WKT_STEP_TARGET_OPEN       },
+    { "cadence"    , FIT_WKT_STEP_TARGET_CADENCE    },
+    { "power"      , FIT_WKT_STEP_TARGET_POWER      },
+    { "grade"      , FIT_WKT_STEP_TARGET_GRADE      },
+    { "resistance" , FIT_WKT_STEP_TARGET_RESISTANCE }
+});
+} // namespace workout_step
+
+// Bytes of the base types il2fit writes
+constexpr std::size_t
+base_size(FIT_UINT8 type)
+{
+    switch (type) {
+    case FIT_BASE_TYPE_UINT16:
+        return 2;
+    case FIT_BASE_TYPE_UINT32:
+    case FIT_BASE_TYPE_UINT32Z:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Their invalid values, what a field is padded with when unset
+constexpr FIT_UINT32
+base_invalid(FIT_UINT8 type)
+{
+    switch (type) {
+    case FIT_BASE_TYPE_ENUM:
+    case FIT_BASE_TYPE_UINT8:
+        return 0xFF;
+    case FIT_BASE_TYPE_UINT16:
+        return 0xFFFF;
+    case FIT_BASE_TYPE_UINT32:
+        return 0xFFFFFFFF;
+    default:
+        return 0;
+    }
+}
+
+// Workout step durations that repeat earlier steps
+constexpr bool
+repeat_duration(FIT_UINT32 type)
+{
+    switch (type) {
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_STEPS_CMPLT:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_TIME:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_DISTANCE:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_CALORIES:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_LESS_THAN:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_HR_GREATER_THAN:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_LESS_THAN:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_GREATER_THAN:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_POWER_LAST_LAP_LESS_THAN:
+    case FIT_WKT_STEP_DURATION_REPEAT_UNTIL_MAX_POWER_LAST_LAP_LESS_THAN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif  // IL2FIT_PROFILE_HPP
@@ -0,0 +1,440 @@
+#ifdef __linux__
+
+#include "server.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::condition_variable;
+using std::deque;
+using std::exception;
+using std::lock_guard;
+using std::mutex;
+using std::pair;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::unique_lock;
+
+namespace {
+
+[[noreturn]]
+void
+error(const string& descr)
+{
+    throw runtime_error(descr);
+}
+
+} // namespace
+
+server::server(const string& path, size_t threads, handler convert) :
+    path_(path),
+    convert_(std::move(convert))
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        error("Bad socket path \"" + path + "\"");
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket left by a previous run that didn't shut down cleanly
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    // Workers inherit the mask, so signals only arrive through signal_
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask_);
+
+    listen_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    done_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    signal_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (listen_ < 0 || epoll_ < 0 || done_ < 0 || signal_ < 0) {
+        shutdown();
+        error("Can't start server");
+    }
+    if (bind(listen_, reinterpret_cast<const sockaddr*>(&addr),
+             sizeof(addr)) != 0 || listen(listen_, SOMAXCONN) != 0) {
+        shutdown();
+        error("Can't listen on \"" + path + "\"");
+    }
+    watch(listen_, EPOLLIN);
+    watch(done_, EPOLLIN);
+    watch(signal_, EPOLLIN);
+
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&server::work, this);
+    }
+}
+
+server::~server()
+{
+    shutdown();
+}
+
+void
+server::shutdown()
+{
+    {
+        lock_guard<mutex> lock(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) {
+        t.join();
+    }
+    workers_.clear();
+
+    for (const auto& c : connections_) {
+        close(c.first);
+    }
+    connections_.clear();
+    for (const int fd : { listen_, epoll_, done_, signal_ }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (listen_ >= 0) {
+        unlink(path_.c_str());
+    }
+    listen_ = epoll_ = done_ = signal_ = -1;
+
+    pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+}
+
+void
+server::run()
+{
+    epoll_event events[64];
+
+    for (;;) {
+        const int n = epoll_wait(epoll_, events, 64, -1);
+        if (n < 0 && errno != EINTR) {
+            error("Can't wait for connections");
+        }
+        for (int i = 0; i < n; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == signal_) {
+                // Consume it, or it's delivered once unblocked
+                signalfd_siginfo info;
+                [[maybe_unused]] const auto n = read(signal_, &info,
+                                                     sizeof(info));
+                return;
+            } else if (fd == listen_) {
+                accept_all();
+            } else if (fd == done_) {
+                finish();
+            } else if (events[i].events & EPOLLOUT) {
+                send(fd);
+            } else {
+                receive(fd);
+            }
+        }
+    }
+}
+
+void
+server::watch(int fd, uint32_t events)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        error("Can't watch connection");
+    }
+}
+
+void
+server::accept_all()
+{
+    for (;;) {
+        const int fd = accept4(listen_, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                !connections_.empty()) {
+                // Out of descriptors or memory. The listening socket stays
+                // readable, so it leaves epoll until a connection is dropped
+                // rather than waking it up in a loop.
+                epoll_ctl(epoll_, EPOLL_CTL_DEL, listen_, nullptr);
+                accepting_ = false;
+            }
+            return;
+        }
+        connections_[fd];
+        watch(fd, EPOLLIN | EPOLLRDHUP);
+    }
+}
+
+void
+server::receive(int fd)
+{
+    const auto it = connections_.find(fd);
+    if (it == connections_.end()) {
+        return;
+    }
+    auto& c = it->second;
+    char buf[65536];
+
+    for (;;) {
+        const auto n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            // Closing with unread data would reset the connection, and the
+            // client would never read the error, so read it all first
+            if (c.too_large || c.in.size() + n > max_request) {
+                c.too_large = true;
+                c.in = string();
+            } else {
+                c.in.append(buf, n);
+            }
+        } else if (n == 0) {
+            if (c.too_large) {
+                reply(fd, "\1Request too large");
+                return;
+            }
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            drop(fd);
+            return;
+        }
+    }
+
+    // Whole request is in. The connection leaves epoll until its reply
+    // is ready, and keeps its descriptor, so that it can't be reused for
+    // another connection meanwhile.
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    {
+        lock_guard<mutex> lock(m_);
+        requests_.emplace_back(fd, std::move(c.in));
+    }
+    cv_.notify_one();
+    c.in = string();
+}
+
+void
+server::reply(int fd, string out)
+{
+    auto& c = connections_[fd];
+    c.in = string();
+    c.out = std::move(out);
+    c.sent = 0;
+
+    epoll_event ev{};
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+        epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        drop(fd);
+        return;
+    }
+    send(fd);
+}
+
+void
+server::send(int fd)
+{
+    // Events for a dropped connection may still come in the same batch,
+    // possibly for a new one that got its descriptor
+    const auto it = connections_.find(fd);
+    if (it == connections_.end() || it->second.out.empty()) {
+        return;
+    }
+    auto& c = it->second;
+
+    while (c.sent < c.out.size()) {
+        const auto n = ::send(fd, c.out.data() + c.sent,
+                              c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (n >= 0) {
+            c.sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    drop(fd);
+}
+
+void
+server::finish()
+{
+    uint64_t count;
+    while (read(done_, &count, sizeof(count)) > 0) {
+    }
+
+    deque<pair<int, string>> ready;
+    {
+        lock_guard<mutex> lock(m_);
+        ready.swap(replies_);
+    }
+    for (auto& r : ready) {
+        reply(r.first, std::move(r.second));
+    }
+}
+
+void
+server::drop(int fd)
+{
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections_.erase(fd);
+    if (!accepting_) {
+        accepting_ = true;
+        watch(listen_, EPOLLIN);
+    }
+}
+
+void
+server::work()
+{
+    for (;;) {
+        pair<int, string> request;
+        {
+            unique_lock<mutex> lock(m_);
+            cv_.wait(lock, [this] { return stop_ || !requests_.empty(); });
+            if (stop_) {
+                return;
+            }
+            request = std::move(requests_.front());
+            requests_.pop_front();
+        }
+
+        string out(1, '\0');
+        try {
+            convert_(request.second, out);
+        } catch (const exception& exn) {
+            out = string("\1") + exn.what();
+        }
+
+        {
+            lock_guard<mutex> lock(m_);
+            replies_.emplace_back(request.first, std::move(out));
+        }
+        const uint64_t one = 1;
+        [[maybe_unused]] const auto n = write(done_, &one, sizeof(one));
+    }
+}
+
+//----------------------------------------------------------------------------
+// Tests
+
+#ifdef _WITH_TESTS
+
+#include <catch.hpp>
+
+#include <filesystem>
+
+#include "il2fit.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string_view;
+using std::thread;
+
+namespace {
+
+// What a client gets back for il
+string
+request(const string& path, string_view il)
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    REQUIRE(fd >= 0);
+    REQUIRE(connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                    sizeof(addr)) == 0);
+
+    // The server may stop reading early, and the reply is still read
+    for (size_t sent = 0; sent < il.size();) {
+        const auto n = ::send(fd, il.data() + sent, il.size() - sent,
+                              MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    ::shutdown(fd, SHUT_WR);
+
+    string ans;
+    char buf[4096];
+    for (ssize_t n; (n = read(fd, buf, sizeof(buf))) > 0;) {
+        ans.append(buf, n);
+    }
+    close(fd);
+    return ans;
+}
+
+} // namespace
+
+TEST_CASE("Convert on a socket", "[server]")
+{
+    const auto path = (fs::temp_directory_path() /
+                       ("il2fit-test-" + std::to_string(getpid()) +
+                        ".sock")).string();
+    const string il =
+        "begin\n"
+        "workout\n"
+        "wkt_name\n"
+        "Sweet spot\n"
+        "end\n"
+        "workout\n"
+        "begin\n"
+        "workout_step\n"
+        "duration_time\n"
+        "60\n"
+        "end\n"
+        "workout_step\n";
+    const string bad = "begin\nnonsense\n";
+    string bad_error;
+    try {
+        wrked::convert(bad);
+    } catch (const exception& exn) {
+        bad_error = exn.what();
+    }
+    REQUIRE(!bad_error.empty());
+
+    server srv(path, 2, [](string_view il, string& fit) {
+        fit += wrked::convert(il);
+    });
+    thread t(&server::run, &srv);
+
+    CHECK(request(path, il) == string(1, '\0') + wrked::convert(il));
+    CHECK(request(path, bad) == "\1" + bad_error);
+    CHECK(request(path, il) == string(1, '\0') + wrked::convert(il));
+
+    // Read to the end, so the client gets the error rather than a reset
+    CHECK(request(path, string(size_t(128) << 20, ' ')) ==
+          "\1Request too large");
+    CHECK(request(path, il) == string(1, '\0') + wrked::convert(il));
+
+    // Blocked on every thread, so it waits for run()
+    kill(getpid(), SIGTERM);
+    t.join();
+}
+
+#endif  // _WITH_TESTS
+
+#endif  // __linux__
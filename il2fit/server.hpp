@@ -0,0 +1,105 @@
+#ifndef IL2FIT_SERVER_HPP
+#define IL2FIT_SERVER_HPP
+
+#ifdef __linux__
+
+#include <csignal>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Resident converter on a Unix socket. A client writes one IL document
+// and shuts down its side for writing, then reads the reply until the
+// server closes the connection: a 0 byte and the FIT file, or a 1 byte
+// and the error message. Connections are multiplexed with epoll on one
+// thread, conversions run on a fixed pool of workers.
+class server
+{
+public:
+    // Appends the FIT file for an IL document to its second argument, or
+    // throws with the error message. Called on the workers, several at
+    // once.
+    using handler = std::function<void (std::string_view, std::string&)>;
+
+    // Listens on path, replacing a socket left there. Blocks SIGINT and
+    // SIGTERM until destroyed, so run() can wait for them.
+    server(const std::string& path, std::size_t threads, handler convert);
+
+    server(const server&) = delete;
+    server& operator=(const server&) = delete;
+
+    ~server();
+
+    // Until SIGINT or SIGTERM
+    void
+    run();
+
+private:
+    // Larger requests are refused rather than buffered
+    static constexpr std::size_t max_request = std::size_t(64) << 20;
+
+    struct connection
+    {
+        std::string in;
+        std::string out;
+        std::size_t sent = 0;
+        bool too_large = false;     // Discarding the rest of the request
+    };
+
+    void
+    watch(int fd, std::uint32_t events);
+
+    void
+    accept_all();
+
+    void
+    receive(int fd);
+
+    void
+    reply(int fd, std::string out);
+
+    void
+    send(int fd);
+
+    void
+    finish();
+
+    void
+    drop(int fd);
+
+    void
+    work();
+
+    void
+    shutdown();
+
+    std::string path_;
+    handler convert_;
+    int listen_ = -1;
+    bool accepting_ = true;     // listen_ is in epoll
+    int epoll_ = -1;
+    int done_ = -1;             // eventfd, signalled by workers
+    int signal_ = -1;
+    sigset_t old_mask_;
+    std::unordered_map<int, connection> connections_;
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<std::pair<int, std::string>> requests_;
+    std::deque<std::pair<int, std::string>> replies_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#endif  // __linux__
+
+#endif  // IL2FIT_SERVER_HPP
@@ -0,0 +1,142 @@
+#ifndef IL2FIT_TABLE_HPP
+#define IL2FIT_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+// Compile-time perfect hash tables, of IL keywords and of the names of
+// FIT enum values
+
+constexpr std::uint32_t
+hash(std::string_view s, std::uint32_t seed)
+{
+    // FNV-1a, seeded through the offset basis
+    std::uint32_t h = 2166136261u ^ (seed * 16777619u);
+    for (const auto c : s) {
+        h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return h ^ (h >> 16);
+}
+
+constexpr std::size_t
+table_size(std::size_t n)
+{
+    std::size_t ans = 1;
+    while (ans < 4 * n) {
+        ans <<= 1;
+    }
+    return ans;
+}
+
+template <class T>
+struct keyword
+{
+    std::string_view name;
+    T value;
+};
+
+// Maps names to values with a hash seed chosen at compile time so that
+// no two names share a slot. A lookup is one hash, one slot and one
+// string comparison.
+template <class T, std::size_t N>
+class table
+{
+public:
+    static_assert(N > 0 && N < 0xFF, "Bad table size");
+
+    constexpr
+    table(const keyword<T> (&entries)[N])
+    {
+        for (std::size_t i = 0; i < N; ++i) {
+            for (std::size_t j = 0; j < i; ++j) {
+                if (entries[i].name == entries[j].name) {
+                    throw std::logic_error("Duplicate key");
+                }
+            }
+            entries_[i] = entries[i];
+        }
+        while (!place()) {
+            ++seed_;
+        }
+    }
+
+    constexpr const T*
+    find(std::string_view name) const
+    {
+        const auto i = slots_[hash(name, seed_) & (size - 1)];
+        if (i == empty || entries_[i].name != name) {
+            return nullptr;
+        }
+        return &entries_[i].value;
+    }
+
+    // Name of a value, by linear search
+    constexpr const std::string_view*
+    name(const T& value) const
+    {
+        for (const auto& e : entries_) {
+            if (e.value == value) {
+                return &e.name;
+            }
+        }
+        return nullptr;
+    }
+
+    // Value for a name known at compile time, e.g. in case labels
+    constexpr const T&
+    operator[](std::string_view name) const
+    {
+        const auto ans = find(name);
+        if (!ans) {
+            throw std::out_of_range("No such key");
+        }
+        return *ans;
+    }
+
+private:
+    static constexpr std::size_t size = table_size(N);
+    static constexpr unsigned char empty = 0xFF;
+
+    constexpr bool
+    place()
+    {
+        for (auto& s : slots_) {
+            s = empty;
+        }
+        for (std::size_t i = 0; i < N; ++i) {
+            auto& s = slots_[hash(entries_[i].name, seed_) & (size - 1)];
+            if (s != empty) {
+                return false;
+            }
+            s = static_cast<unsigned char>(i);
+        }
+        return true;
+    }
+
+    keyword<T> entries_[N] = {};
+    unsigned char slots_[size] = {};
+    std::uint32_t seed_ = 0;
+};
+
+template <class T, std::size_t N>
+constexpr table<T, N>
+make_table(const keyword<T> (&entries)[N])
+{
+    return table<T, N>(entries);
+}
+
+// Table of names mapped to their positions
+template <std::size_t N>
+constexpr table<std::size_t, N>
+keywords(const std::string_view (&names)[N])
+{
+    keyword<std::size_t> entries[N] = {};
+    for (std::size_t i = 0; i < N; ++i) {
+        entries[i] = { names[i], i };
+    }
+    return table<std::size_t, N>(entries);
+}
+
+#endif  // IL2FIT_TABLE_HPP
@@ -0,0 +1,235 @@
+#include "verify.hpp"
+
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "crc.hpp"
+
+using std::nullopt;
+using std::optional;
+using std::ostringstream;
+using std::runtime_error;
+using std::size_t;
+using std::string_view;
+
+#define S(_expr)                                                   \
+    static_cast<ostringstream&>(                                   \
+        ostringstream().flush() << _expr).str()
+
+namespace {
+
+unsigned
+octet(char c)
+{
+    return static_cast<unsigned char>(c);
+}
+
+FIT_UINT32
+fit_le(string_view b, size_t pos, size_t n)
+{
+    FIT_UINT32 ans = 0;
+    for (size_t i = n; i > 0; --i) {
+        ans = ans << 8 | octet(b[pos + i - 1]);
+    }
+    return ans;
+}
+
+// Value of a field in a data record, if the message has it
+optional<FIT_UINT32>
+field_value(const local_mesg& m, string_view data, FIT_UINT8 num)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < m.fields.size(); i += 3) {
+        const auto size = octet(m.fields[i + 1]);
+        if (octet(m.fields[i]) == num && size > 0 && size <= 4) {
+            FIT_UINT32 ans = 0;
+            for (size_t k = 0; k < size; ++k) {
+                const auto i = m.big_endian ? k : size - 1 - k;
+                ans = ans << 8 | octet(data[pos + i]);
+            }
+            return ans;
+        }
+        pos += size;
+    }
+    return nullopt;
+}
+
+// Steps of the workout in one FIT file
+class step_checker
+{
+public:
+    void
+    workout(const local_mesg& m, string_view data)
+    {
+        using namespace workout;
+        const auto n = field_value(m, data, num_valid_steps.num);
+        if (n && n.value() != base_invalid(num_valid_steps.type)) {
+            valid_steps_ = n;
+        }
+    }
+
+    void
+    step(const local_mesg& m, string_view data, size_t offset)
+    {
+        using namespace workout_step;
+        const auto index = field_value(m, data, message_index.num);
+        if (!index) {
+            bad_fit(offset, "Workout step without message_index");
+        }
+        if ((index.value() & 0x0FFF) != count_) {
+            bad_fit(offset, S("Workout step " << (index.value() & 0x0FFF)
+                              << ", expected " << count_));
+        }
+        const auto type = field_value(m, data, duration_type.num);
+        if (type && repeat_duration(type.value())) {
+            const auto from = field_value(m, data, duration_value.num);
+            if (!from || from.value() >= count_) {
+                bad_fit(offset, S("Workout step " << count_
+                                  << " repeats from step "
+                                  << (from ? S(from.value()) : "none")));
+            }
+        }
+        ++count_;
+    }
+
+    void
+    finish(size_t offset) const
+    {
+        if (valid_steps_ && valid_steps_.value() != count_) {
+            bad_fit(offset, S("Workout has " << count_ << " steps, "
+                              << valid_steps_.value() << " declared"));
+        }
+    }
+
+private:
+    size_t count_ = 0;
+    optional<FIT_UINT32> valid_steps_;
+};
+
+} // namespace
+
+void
+bad_fit(size_t offset, string_view descr)
+{
+    throw runtime_error(S("Offset " << offset << ": " << descr));
+}
+
+size_t
+walk_fit(string_view b, size_t base, const fit_record& record)
+{
+    if (b.size() < 12 || (octet(b[0]) != 12 && octet(b[0]) != 14) ||
+        b.substr(8, 4) != ".FIT") {
+        bad_fit(base, "Not a FIT file");
+    }
+    const size_t header_size = octet(b[0]);
+    if (b.size() < header_size) {
+        bad_fit(base, "Truncated header");
+    }
+    if (header_size == 14) {
+        const auto crc = fit_le(b, 12, 2);
+        if (crc != 0 && crc != crc16(0, b.substr(0, 12))) {
+            bad_fit(base + 12, "Bad header CRC");
+        }
+    }
+    const size_t end = header_size + fit_le(b, 4, 4);
+    if (end + 2 > b.size()) {
+        bad_fit(base + b.size(), "Truncated FIT file");
+    }
+    if (crc16(0, b.substr(0, end + 2)) != 0) {
+        bad_fit(base + end, "Bad CRC");
+    }
+
+    local_mesg local[FIT_MAX_LOCAL_MESGS];
+
+    for (size_t pos = header_size; pos < end;) {
+        const auto h = octet(b[pos]);
+        const auto offset = base + pos;
+
+        if (!(h & FIT_HDR_TIME_REC_BIT) && (h & FIT_HDR_TYPE_DEF_BIT)) {
+            if (end - pos < 6) {
+                bad_fit(offset, "Truncated definition");
+            }
+            auto& m = local[h & FIT_HDR_TYPE_MASK];
+            m.big_endian = octet(b[pos + 2]) != 0;
+            m.num = fit_le(b, pos + 3, 2);
+            if (m.big_endian) {
+                m.num = m.num >> 8 | (m.num & 0xFF) << 8;
+            }
+            const size_t n = octet(b[pos + 5]);
+            pos += 6;
+            if (end - pos < 3 * n) {
+                bad_fit(offset, "Truncated definition");
+            }
+            m.fields = b.substr(pos, 3 * n);
+            m.size = 0;
+            for (size_t i = 0; i < n; ++i, pos += 3) {
+                m.size += octet(b[pos + 1]);
+            }
+            if (h & FIT_HDR_DEV_DATA_BIT) {
+                if (pos == end) {
+                    bad_fit(offset, "Truncated definition");
+                }
+                const size_t k = octet(b[pos++]);
+                if (end - pos < 3 * k) {
+                    bad_fit(offset, "Truncated definition");
+                }
+                for (size_t i = 0; i < k; ++i, pos += 3) {
+                    m.size += octet(b[pos + 1]);
+                }
+            }
+            m.defined = true;
+            continue;
+        }
+
+        const auto& m = local[h & FIT_HDR_TIME_REC_BIT ?
+                              (h & FIT_HDR_TIME_TYPE_MASK) >>
+                              FIT_HDR_TIME_TYPE_SHIFT :
+                              h & FIT_HDR_TYPE_MASK];
+        if (!m.defined) {
+            bad_fit(offset, "Data record for an undefined message");
+        }
+        ++pos;
+        if (end - pos < m.size) {
+            bad_fit(offset, "Truncated data record");
+        }
+        record(m, b.substr(pos, m.size), offset);
+        pos += m.size;
+    }
+
+    return end + 2;
+}
+
+namespace {
+
+// Check one FIT file at the start of b, and return its size
+size_t
+verify_file(string_view b, size_t base)
+{
+    step_checker steps;
+    const auto size = walk_fit(b, base, [&](const local_mesg& m,
+                                            string_view data,
+                                            size_t offset) {
+            if (m.num == FIT_MESG_NUM_WORKOUT) {
+                steps.workout(m, data);
+            } else if (m.num == FIT_MESG_NUM_WORKOUT_STEP) {
+                steps.step(m, data, offset);
+            }
+        });
+    steps.finish(base + size - 2);
+    return size;
+}
+
+} // namespace
+
+void
+verify(string_view fit)
+{
+    if (fit.empty()) {
+        throw runtime_error("Empty FIT file");
+    }
+    for (size_t pos = 0; pos < fit.size();) {
+        pos += verify_file(fit.substr(pos), pos);
+    }
+}
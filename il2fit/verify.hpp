@@ -0,0 +1,43 @@
+#ifndef IL2FIT_VERIFY_HPP
+#define IL2FIT_VERIFY_HPP
+
+#include <cstddef>
+#include <functional>
+#include <string_view>
+
+#include "profile.hpp"
+
+// Local message definition, pointing into the file
+struct local_mesg
+{
+    bool defined = false;
+    bool big_endian = false;
+    FIT_UINT16 num = FIT_MESG_NUM_INVALID;
+    std::string_view fields;    // Field definitions, 3 bytes each
+    std::size_t size = 0;       // Of its data records, without header
+};
+
+// A data record of a local message, and its offset in the input
+using fit_record =
+    std::function<void (const local_mesg& m, std::string_view data,
+                        std::size_t offset)>;
+
+// Walk one FIT file at the start of b, checking its structure and CRCs,
+// and pass its data records to record. Returns the file size. Offsets,
+// in errors too, count from base.
+std::size_t
+walk_fit(std::string_view b, std::size_t base, const fit_record& record);
+
+// Check the structure and CRCs of a FIT file, or of FIT files chained
+// one after another, and that workout steps are numbered in order and
+// only repeat steps before them. Throws std::runtime_error at the first
+// problem found.
+void
+verify(std::string_view fit);
+
+// std::runtime_error at an offset in a FIT file
+[[noreturn]]
+void
+bad_fit(std::size_t offset, std::string_view descr);
+
+#endif  // IL2FIT_VERIFY_HPP
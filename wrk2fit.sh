@@ -1,4 +1,4 @@
 #!/bin/sh
 
 D=$(dirname $0)
-$D/wrk2il "$@" | $D/il2fit
+$D/wrk2il -mode bin "$@" | $D/il2fit
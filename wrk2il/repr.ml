@@ -140,15 +140,16 @@ module Il = struct
       Power.Absolute w      -> (w :> int) + 1000
     | Power.Percent percent -> (percent :> int)
 
-  let p_line ch line = IO.(nwrite ch line; write ch '\n')
+  (* Fields go to ch, which writes them as text or binary IL *)
+  type value = Str of string | Int of int | Float of float | Int32 of int32
 
-  let p_field ch k v = p_line ch k; p_line ch v
+  let p_field ch k v = ch k (Str v)
 
-  let p_int_field ch k = p_field ch k % string_of_int
+  let p_int_field ch k v = ch k (Int v)
 
-  let p_float_field ch k = p_field ch k % string_of_float
+  let p_float_field ch k v = ch k (Float v)
 
-  let p_int32_field ch k = p_field ch k % Int32.to_string
+  let p_int32_field ch k v = ch k (Int32 v)
 
   let p_duration ch cond =
     let duration_type, field_name, value =
@@ -307,7 +308,7 @@ module Il = struct
     | (Step.Repeat {Step.steps; _}) :: tail ->
       1 + (n_steps (Non_empty_list.to_list steps)) + (n_steps tail)
 
-  let to_channel ch ({name; sport; steps} as workout) =
+  let p_workout ch ({name; sport; steps} as workout) =
     p_field ch "begin" "file_id";
     p_field ch "end" "file_id";
     p_field ch "begin" "workout";
@@ -319,4 +320,110 @@ module Il = struct
     p_field ch "end" "workout";
     ignore (
       List.fold_left (p_step ch) 0 (Non_empty_list.to_list steps))
+
+  let text_field chan k v =
+    let p_line line = IO.(nwrite chan line; write chan '\n') in
+    p_line k;
+    p_line (match v with
+          Str s   -> s
+        | Int n   -> string_of_int n
+        | Float f -> string_of_float f
+        | Int32 n -> Int32.to_string n)
+
+  let to_channel chan = p_workout (text_field chan)
+
+  (* Binary IL, see il2fit.cpp. Message numbers and field keys are
+     positions in il2fit's lists, numbers are written the way il2fit
+     parses the field. *)
+  let binary_magic = "\x89IL1"
+
+  let binary_messages =
+    [ "file_creator"; "file_id"; "workout"; "workout_step" ]
+
+  let binary_fields = function
+      "file_creator" ->
+      [ "hardware_version", `U32; "software_version", `U32 ]
+    | "file_id" ->
+      [ "number", `U32; "serial_number", `U32; "time_created", `U32 ]
+    | "workout" ->
+      [ "capabilities", `U32; "num_valid_steps", `U32;
+        "sport", `Str; "wkt_name", `Str ]
+    | "workout_step" ->
+      [ "custom_target_cadence_high", `U32;
+        "custom_target_cadence_low", `U32;
+        "custom_target_heart_rate_high", `U32;
+        "custom_target_heart_rate_low", `U32;
+        "custom_target_power_high", `U32;
+        "custom_target_power_low", `U32;
+        "custom_target_speed_high", `F32;
+        "custom_target_speed_low", `F32;
+        "custom_target_value_high", `U32;
+        "custom_target_value_low", `U32;
+        "duration_calories", `U32;
+        "duration_distance", `F32;
+        "duration_hr", `U32;
+        "duration_power", `U32;
+        "duration_step", `U32;
+        "duration_time", `F32;
+        "duration_type", `Str;
+        "duration_value", `U32;
+        "intensity", `Str;
+        "message_index", `U32;
+        "repeat_calories", `U32;
+        "repeat_distance", `F32;
+        "repeat_hr", `U32;
+        "repeat_power", `U32;
+        "repeat_steps", `U32;
+        "repeat_time", `F32;
+        "target_hr_zone", `U32;
+        "target_power_zone", `U32;
+        "target_type", `Str;
+        "target_value", `U32;
+        "wkt_step_name", `Str ]
+    | _ -> invalid_arg "Repr.Il.binary_fields"
+
+  (* FIT strings are null-terminated in fields of at most 255 bytes, so
+     il2fit keeps the first 254 bytes of longer ones, backing up to the
+     start of a UTF-8 character. Cut the same way here. *)
+  let fit_string s =
+    let n = 254 in
+    if String.length s <= n then s
+    else
+      let rec cut i =
+        if i > 0 && Char.code s.[i] land 0xC0 = 0x80 then cut (pred i)
+        else i in
+      String.left s (cut n)
+
+  (* Fields of a message are collected until its end, when the record
+     length is known *)
+  let binary_field chan =
+    let mesg = ref None in
+    fun k v ->
+      match k, v, !mesg with
+        "begin", Str m, None ->
+        mesg := Some (m, binary_fields m, IO.output_string ())
+      | "end", Str m, Some (m', _, payload) when m = m' ->
+        let payload = IO.close_out payload in
+        IO.write_byte chan (Option.get (List.index_of m binary_messages));
+        IO.write_ui16 chan (String.length payload);
+        IO.nwrite chan payload;
+        mesg := None
+      | k, v, Some (_, fields, payload) ->
+        let i, (_, kind) = List.findi (fun _ (k', _) -> k' = k) fields in
+        IO.write_byte payload i;
+        (match kind, v with
+           `U32, Int n   -> IO.write_real_i32 payload (Int32.of_int n)
+         | `U32, Int32 n -> IO.write_real_i32 payload n
+         | `F32, Int n   -> IO.write_float payload (float_of_int n)
+         | `F32, Float f -> IO.write_float payload f
+         | `Str, Str s   ->
+           let s = fit_string s in
+           IO.write_byte payload (String.length s);
+           IO.nwrite payload s
+         | _ -> invalid_arg "Repr.Il.binary_field")
+      | _ -> invalid_arg "Repr.Il.binary_field"
+
+  let to_binary_channel chan workout =
+    IO.nwrite chan binary_magic;
+    p_workout (binary_field chan) workout
 end
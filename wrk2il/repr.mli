@@ -12,4 +12,6 @@ val to_string : Workout.t -> string
 
 module Il : sig
   val to_channel : 'a IO.output -> Workout.t -> unit
+
+  val to_binary_channel : 'a IO.output -> Workout.t -> unit
 end
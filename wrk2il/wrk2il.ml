@@ -11,12 +11,13 @@ let parse_args () =
                                      (Ref.set sport % Option.some %
                                       Workout.Sport.of_string)),
               " Override workout sport";
-              "-mode", Arg.Symbol ([ "min"; "tr" ],
+              "-mode", Arg.Symbol ([ "min"; "tr"; "bin" ],
                                    Ref.set mode % (function
                                        | "min" -> Repr.to_channel
                                        | "tr" -> Repr.Il.to_channel
+                                       | "bin" -> Repr.Il.to_binary_channel
                                        | _ -> invalid_arg "mode")),
-              " Translate or minimize" ]
+              " Translate (text or binary IL) or minimize" ]
     (fun _anon -> ())
     "Process workout description language";
   !name, !sport, !mode